@@ -9,19 +9,237 @@
  ************************************************************************/
 
 #include "whisper.h"
+#include "whisper_batch.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace whisper;
 
+// "-" in place of a path reads from stdin or writes to stdout
+const std::string stdio_path("-");
+
+static std::ostream stdout_data(nullptr);
+
+static bool stats_wanted = false;
+static std::string stats_path;		// empty sends --stats to stderr
+static std::ofstream stats_file;
+
+// Sends data written to stdout_data to stdout and moves status messages on cout over to stderr.
+std::ostream& use_stdout_for_data()
+{
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	stdout_data.rdbuf(cout.rdbuf());
+	cout.rdbuf(cerr.rdbuf());
+	return stdout_data;
+}
+
+std::istream& use_stdin_for_data()
+{
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	return cin;
+}
+
+// Where --stats goes; null if the file cannot be created.
+std::ostream* stats_output()
+{
+	if (stats_path.empty())
+		return &cerr;
+
+	stats_file.open(stats_path, std::ios::out | std::ios::trunc);
+	if (!stats_file)
+	{
+		cout << "Could not create stats file: " << stats_path << endl;
+		return nullptr;
+	}
+	return &stats_file;
+}
+
+void write_stats(const whisper_engine& engine)
+{
+	std::ostream* out = stats_wanted ? stats_output() : nullptr;
+
+	if (out)
+	{
+		write_stats_json(*out, engine.stats());
+		*out << endl;
+	}
+}
+
 void show_usage()
 {
 	cout << "Usage:" << endl;
-	cout << "whisper encode <data_file_path> <sound_file_in_path> <sound_file_out_path>" << endl;
-	cout << "whisper decode <sound_file_in_path> [data_out_path]" << endl;
+	cout << "whisper [options] encode <data_file_path> <sound_file_in_path> <sound_file_out_path>" << endl;
+	cout << "whisper [options] decode <sound_file_in_path> [data_out_path]" << endl;
+	cout << "whisper [options] capacity <sound_file_in_path>" << endl;
+	cout << "whisper [options] apply <delta_path> <sound_file_in_path> <sound_file_out_path>" << endl;
+	cout << "whisper [options] batch <manifest_path>" << endl;
+	cout << "whisper [options] batch encode [data_in_dir sound_in_dir sound_out_dir]" << endl;
+	cout << "whisper [options] batch decode [sound_in_dir data_out_dir]" << endl;
+	cout << "Any path may be - for stdin or stdout; at most one input can come from stdin." << endl;
+	cout << "Options:" << endl;
+	cout << "  --block-size=<bytes>[K|M]   I/O block size (default 4M)" << endl;
+	cout << "  --mmap                      memory-map the sound files instead of streaming them" << endl;
+	cout << "  --async-io                  keep several block reads and writes of the sound files in flight around the" << endl;
+	cout << "                              kernels, through io_uring where the system has it or an I/O thread otherwise" << endl;
+	cout << "  --huge-pages                take I/O blocks of 2M and up from huge pages where the system allows it" << endl;
+	cout << "  --delta                     encode to a delta against the sound file instead of a new one (see apply)" << endl;
+	cout << "  --patch                     encode into a clone of the sound file (a reflink where supported), rewriting" << endl;
+	cout << "                              only the samples up to the last one changed; with the same in and out path," << endl;
+	cout << "                              the sound file itself is changed" << endl;
+	cout << "  --kernel=scalar|avx2|avx512 sample kernels to use (default: best supported)" << endl;
+	cout << "  --bits=1|2|3|4              data bits per eligible sample when encoding (default 1)" << endl;
+	cout << "  --threshold=<factor>|auto   encode in samples of at least 1 << factor (default 11; 8 or 16 more for 24- or 32-bit sound files," << endl;
+	cout << "                              2^(factor - 15) for floating-point ones), or the fewest, loudest that fit" << endl;
+	cout << "  --threads=<count>           worker threads, or concurrent jobs in a batch (default: one per hardware thread)" << endl;
+	cout << "  --name=<file_name>          file name stored with data read from stdin (default stdin.dat)" << endl;
+	cout << "  --stats[=<path>]            write the time, samples, bits, bytes and I/O calls of each stage of an encode" << endl;
+	cout << "                              or decode (per job in a batch) as JSON, to stderr or the file at path" << endl;
 }
 
-int main(int argc, char **argv)
+bool parse_size(const std::string& text, size_t& size)
+{
+	size_t pos = 0;
+	unsigned long long value = 0;
+
+	try
+	{
+		value = std::stoull(text, &pos);
+	}
+	catch (...)
+	{
+		return false;
+	}
+
+	std::string suffix = text.substr(pos);
+	if (suffix == "K" || suffix == "k")
+		value <<= 10;
+	else if (suffix == "M" || suffix == "m")
+		value <<= 20;
+	else if (!suffix.empty())
+		return false;
+
+	size = (size_t)value;
+	return true;
+}
+
+// Applies leading "--name=value" options to the engine and strips them from argv.
+bool parse_options(int& argc, char**& argv, whisper_engine& engine, std::vector<char*>& positional, std::string& data_name)
+{
+	positional.push_back(argv[0]);
+
+	for (int index = 1; index < argc; index++)
+	{
+		std::string arg = argv[index];
+		size_t size = 0;
+
+		if (arg.rfind("--block-size=", 0) == 0)
+		{
+			if (!parse_size(arg.substr(13), size) || !engine.set_io_block_size(size))
+				return false;
+		}
+		else if (arg == "--mmap")
+		{
+			engine.set_io_mode(io_mapped);
+		}
+		else if (arg == "--async-io")
+		{
+			engine.set_io_mode(io_async);
+		}
+		else if (arg == "--huge-pages")
+		{
+			shared_buffer_pool().set_huge_pages(true);
+			engine.set_buffer_pool(&shared_buffer_pool());
+		}
+		else if (arg == "--delta")
+		{
+			engine.set_delta_output(true);
+		}
+		else if (arg == "--patch")
+		{
+			engine.set_io_mode(io_patched);
+		}
+		else if (arg.rfind("--threads=", 0) == 0)
+		{
+			if (!parse_size(arg.substr(10), size))
+				return false;
+			engine.set_thread_count(size);
+		}
+		else if (arg.rfind("--bits=", 0) == 0)
+		{
+			if (!parse_size(arg.substr(7), size) || !engine.set_mask_factor((uint32_t)size))
+				return false;
+		}
+		else if (arg == "--threshold=auto")
+		{
+			engine.set_threshold_factor(0);
+		}
+		else if (arg.rfind("--threshold=", 0) == 0)
+		{
+			if (!parse_size(arg.substr(12), size) || !size || !engine.set_threshold_factor((uint32_t)size))
+				return false;
+		}
+		else if (arg.rfind("--kernel=", 0) == 0)
+		{
+			std::string name = arg.substr(9);
+			if (name == "scalar")
+				engine.set_kernel_level(simd_scalar);
+			else if (name == "avx2")
+				engine.set_kernel_level(simd_avx2);
+			else if (name == "avx512")
+				engine.set_kernel_level(simd_avx512);
+			else
+			{
+				cout << "Unknown kernel: " << name << endl;
+				return false;
+			}
+		}
+		else if (arg.rfind("--name=", 0) == 0)
+		{
+			data_name = arg.substr(7);
+		}
+		else if (arg == "--stats")
+		{
+			stats_wanted = true;
+		}
+		else if (arg.rfind("--stats=", 0) == 0)
+		{
+			stats_wanted = true;
+			stats_path = arg.substr(8);
+		}
+		else if (arg.rfind("--", 0) == 0)
+		{
+			cout << "Unknown option: " << arg << endl;
+			return false;
+		}
+		else
+		{
+			positional.push_back(argv[index]);
+		}
+	}
+
+	argc = (int)positional.size();
+	argv = positional.data();
+	return true;
+}
+
+int whisper_main(int argc, char **argv)
 {
 	whisper_engine my_whisper;
+	std::vector<char*> positional;
+	std::string data_name = "stdin.dat";
+
+	if (!parse_options(argc, argv, my_whisper, positional, data_name))
+	{
+		show_usage();
+		return -__LINE__;
+	}
 
 	if (argc < 3)
 	{
@@ -34,6 +252,9 @@ int main(int argc, char **argv)
 
 	cmds.insert("encode");
 	cmds.insert("decode");
+	cmds.insert("capacity");
+	cmds.insert("apply");
+	cmds.insert("batch");
 
     std::string cmd = argv[1];
 
@@ -68,48 +289,71 @@ int main(int argc, char **argv)
 		auto p_data_in = std::filesystem::path(data_in);
 		auto p_music_out = std::filesystem::path(music_out);
 
-		if (!std::filesystem::exists(p_music_in))
+		if (music_out == stdio_path)
+		{
+			my_whisper.set_out_musicstream(use_stdout_for_data());
+		}
+		if (music_in == stdio_path && data_in == stdio_path)
+		{
+			std::cout << "Source data and media cannot both be read from stdin. Try again." << std::endl;
+			return -__LINE__;
+		}
+		if (music_in != stdio_path && !std::filesystem::exists(p_music_in))
 		{
 			std::cout << "No such file:  " << music_in << std::endl;
 			return -__LINE__;
 		}
-		if (!std::filesystem::is_regular_file(p_music_in))
+		if (music_in != stdio_path && !std::filesystem::is_regular_file(p_music_in))
 		{
 			std::cout << music_in << " must be a regular file" << std::endl;
 			return -__LINE__;
 		}
-		if (!std::filesystem::exists(p_data_in))
+		if (data_in != stdio_path && !std::filesystem::exists(p_data_in))
 		{
 			std::cout << "No such file:  " << data_in << std::endl;
 			return -__LINE__;
 		}
-		if (!std::filesystem::is_regular_file(p_data_in))
+		if (data_in != stdio_path && !std::filesystem::is_regular_file(p_data_in))
 		{
 			std::cout << data_in << " must be a regular file" << endl;
 			return -__LINE__;
 		}
-		if (p_music_in == p_data_in)
+		if (data_in != stdio_path && p_music_in == p_data_in)
 		{
 			std::cout << "Source data and media cannot be the same file. Try again." << std::endl;
 			return -__LINE__;
 		}
-		if (p_music_out == p_data_in)
+		if (data_in != stdio_path && p_music_out == p_data_in)
 		{
 			std::cout << "Source data and media cannot be the same file. Try again." << std::endl;
 			return -__LINE__;
 		}
-		if (p_music_in == p_music_out)
+		if (music_in != stdio_path && p_music_in == p_music_out && my_whisper.get_io_mode() != io_patched)
 		{
 			std::cout << "Media files may not be the same. Try again." << std::endl;
 			return -__LINE__;
 		}
 
-		my_whisper.set_in_datafile_name(p_data_in);
-		my_whisper.set_in_musicpath(p_music_in);
-		my_whisper.set_out_musicpath(p_music_out);
-		my_whisper.open_files_for_encoding();
-		my_whisper.encode_data();
+		if (data_in == stdio_path)
+			my_whisper.set_in_datastream(use_stdin_for_data(), data_name);
+		else
+			my_whisper.set_in_datafile_name(p_data_in);
+		if (music_in == stdio_path)
+			my_whisper.set_in_musicstream(use_stdin_for_data());
+		else
+			my_whisper.set_in_musicpath(p_music_in);
+		if (music_out != stdio_path)
+			my_whisper.set_out_musicpath(p_music_out);
+		if (my_whisper.open_files_for_encoding())
+		{
+			return -__LINE__;
+		}
+		if (my_whisper.encode_data())
+		{
+			return -__LINE__;
+		}
 		my_whisper.close_files();
+		write_stats(my_whisper);
 
 		cout << "Done" << endl;
 		return 0;
@@ -138,37 +382,138 @@ int main(int argc, char **argv)
 
 		auto p_music_in = filesystem::path(music_in);
 
-		if (!filesystem::exists(p_music_in))
+		if (music_in == stdio_path)
+		{
+			my_whisper.set_in_musicstream(use_stdin_for_data());
+		}
+		else if (!filesystem::exists(p_music_in))
 		{
 			cout << "No such file:  " << music_in << endl;
 			return -1;
 		}
-		if (!filesystem::is_regular_file(p_music_in))
+		else if (!filesystem::is_regular_file(p_music_in))
 		{
 			cout << music_in << " must be a regular file" << endl;
 			return -1;
 		}
-		if (!filesystem::exists(p_data_out))
+		else
+		{
+			my_whisper.set_in_musicpath(p_music_in);
+		}
+
+		if (data_out == stdio_path)
+		{
+			my_whisper.set_out_datastream(use_stdout_for_data());
+		}
+		else if (!filesystem::exists(p_data_out))
 		{
 			cout << "Directory path does not exist: " << data_out << endl;
 			return -1;
 		}
-		if (!filesystem::is_directory(p_data_out))
+		else if (!filesystem::is_directory(p_data_out))
 		{
 			cout << "Data path is not a directory: " << data_out << endl;
 			return -1;
 		}
-		if (p_music_in == p_data_out)
+		else if (p_music_in == p_data_out)
 		{
 			std::cout << "Source media and data file cannot be the same. Try again." << std::endl;
 			return -1;
 		}
+		else
+		{
+			my_whisper.set_out_datapath(p_data_out);
+		}
+		if (my_whisper.open_files_for_decoding())
+		{
+			return -__LINE__;
+		}
+		if (my_whisper.decode_data())
+		{
+			return -__LINE__;
+		}
+		my_whisper.close_files();
+		write_stats(my_whisper);
+	}
+	else if (cmd == "capacity")
+	{
+		if (argc != 3)
+		{
+			show_usage();
+			return -1;
+		}
 
-		my_whisper.set_out_datapath(p_data_out);
-		my_whisper.set_in_musicpath(p_music_in);
-		my_whisper.open_files_for_decoding();
-		my_whisper.decode_data();
+		if (argv[2] == stdio_path)
+			my_whisper.set_in_musicstream(use_stdin_for_data());
+		else
+			my_whisper.set_in_musicpath(path(argv[2]));
+		if (my_whisper.open_files_for_analysis())
+		{
+			return -__LINE__;
+		}
+		status = my_whisper.report_capacity();
+		my_whisper.close_files();
+		return status;
+	}
+	else if (cmd == "apply")
+	{
+		if (argc != 5)
+		{
+			show_usage();
+			return -1;
+		}
+
+		// the same in and out path applies the delta to the sound file itself
+		my_whisper.set_io_mode(io_patched);
+		my_whisper.set_in_musicpath(path(argv[3]));
+		my_whisper.set_out_musicpath(path(argv[4]));
+		if (my_whisper.apply_delta(path(argv[2])))
+		{
+			return -__LINE__;
+		}
+		cout << "Done" << endl;
+		return 0;
+	}
+	else if (cmd == "batch")
+	{
+		std::vector<batch_job> jobs;
+		std::string mode = argv[2];
+		bool listed = false;
+
+		if (mode == "encode" && argc == 3)
+			listed = list_batch_encode_jobs(default_data_inpath_str, default_inpath_str, default_outpath_str, jobs);
+		else if (mode == "encode" && argc == 6)
+			listed = list_batch_encode_jobs(argv[3], argv[4], argv[5], jobs);
+		else if (mode == "decode" && argc == 3)
+			listed = list_batch_decode_jobs(default_outpath_str, default_data_outpath_str, jobs);
+		else if (mode == "decode" && argc == 5)
+			listed = list_batch_decode_jobs(argv[3], argv[4], jobs);
+		else if (mode != "encode" && mode != "decode" && argc == 3)
+			listed = read_batch_manifest(mode, jobs);
+		else
+		{
+			show_usage();
+			return -1;
+		}
+
+		if (!listed)
+		{
+			return -__LINE__;
+		}
+		return run_batch(jobs, my_whisper, stats_wanted ? stats_output() : nullptr) ? -1 : 0;
 	}
 	cout << "Done" << endl;
 	return status;
 }
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		return whisper_main(argc, argv);
+	}
+	catch (const whisper_error&)
+	{
+		return -1;
+	}
+}
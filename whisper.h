@@ -19,6 +19,18 @@
 #include <string>
 #include <cstring>
 #include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+#include <functional>
+
+#include "whisper_io.h"
+#include "whisper_async_io.h"
+#include "whisper_kernels.h"
+#include "whisper_delta.h"
+#include "whisper_threads.h"
+#include "whisper_stats.h"
 
 using namespace std;
 using namespace std::filesystem;
@@ -33,6 +45,12 @@ namespace whisper
 	const std::string default_data_inpath_str("WhisperFiles\\data_in");
 	const std::string default_data_outpath_str("WhisperFiles\\data_out");
 
+	const size_t max_spooled_bytes = 64 << 20;	// payload read ahead from a stream before it goes to a temporary file
+
+	// Asked before a job creates an output file; false refuses it, such as when another job of a
+	// batch writes the same path.
+	typedef std::function<bool(const filesystem::path& file_path)> output_claim;
+
 #pragma pack(push, 1)
 
 	typedef struct RiffChunk
@@ -60,6 +78,17 @@ namespace whisper
 		int32_t	size;
 	} DataHeader;
 
+	// RF64 and BW64 carriers start with a ds64 chunk holding the 64-bit sizes; the RIFF and data
+	// size fields proper are then 0xffffffff. A table of other large chunks may follow.
+	typedef struct DataSize64Chunk
+	{
+		char	id[4];
+		int32_t	size;
+		uint64_t riffsize;
+		uint64_t datasize;
+		uint64_t samplecount;
+	} DataSize64Chunk;
+
 	typedef struct WavMetadata
 	{
 		RiffChunk	riff;
@@ -67,6 +96,10 @@ namespace whisper
 		DataHeader	dataheader;
 	} WavMetadata;
 
+	const int16_t wave_format_pcm = 1;
+	const int16_t wave_format_ieee_float = 3;
+	const int16_t wave_format_extensible = (int16_t)0xfffe;	// the format proper is the first two bytes of its SubFormat GUID
+
 	typedef union SampleData
 	{
 		int16_t	channels[2];
@@ -81,7 +114,9 @@ namespace whisper
 			mask_factor : 3,				// mask = ((1 << mask_factor) - 1) & ((1 << threshold_factor) - 1)
 			ignore_sign : 1,				// only default (false) is currently supported
 			skip_min_neg_sample_value : 1,  // default is false, but this flag is currently ignored, so effectively, the sample is always skipped
-			unused : 9,
+			explicit_threshold : 1,			// threshold_factor applies to the filename and data; otherwise they use 0x800, like this metadata
+			metadata_version : 2,			// 0: data_byte_count is all there is; 1: an extended_metadata follows
+			unused : 6,
 			filename_size : 10;				// This allows for an excessive amount of metadata for which sufficient space may not be available: YMMV!
 	} attribit_fields;
 
@@ -89,14 +124,60 @@ namespace whisper
 	{
 		uint8_t  magic[7];                 //should be { 'W','H','I','S','P','E','R' }
 		attribit_fields attribits;
-		uint32_t data_byte_count;          // size of data to be embedded
+		uint32_t data_byte_count;          // size of data to be embedded (the lower half, past version 0)
 	} fixed_metadata;
+
+	// Embedded right after fixed_metadata, on a fresh sample and at the same threshold.
+	typedef struct extended_metadata
+	{
+		uint32_t data_byte_count_high;     // upper half of the size of the data
+	} extended_metadata;
+
+	const uint32_t newest_metadata_version = 1;
 #pragma pack(pop)
 
+	typedef struct capacity_report
+	{
+		uint64_t sample_count;             // samples after the WAV header
+		uint64_t metadata_samples;         // samples taken by the whisper metadata
+		bool metadata_fits;
+		sample_format format;
+		uint64_t at_least[wide_magnitude_classes];  // samples after the metadata at or above threshold index
+	} capacity_report;
+
+	enum whisper_status
+	{
+		whisper_ok = 0,
+		whisper_invalid_argument,		// unusable paths, file names, or spans
+		whisper_file_error,				// a file could not be found, opened, created or mapped
+		whisper_read_error,				// media or data could not be read, or ended early
+		whisper_write_error,
+		whisper_unsupported_media,		// not a WAV file whisper can work with
+		whisper_not_enough_space,		// the carrier has too few eligible samples for the data
+		whisper_no_hidden_data,			// no whisper metadata in the carrier
+		whisper_buffer_too_small,		// an output span cannot hold the result
+		whisper_out_of_memory,
+		whisper_carrier_mismatch		// a delta was made from another carrier
+	};
+
+	const char* whisper_status_text(whisper_status status);
+
+	// Raised where a job cannot go on; the reason has already gone to the engine's message
+	// stream. The command line turns it into a failed exit, and a batch into a failed job.
+	class whisper_error : public std::runtime_error
+	{
+	private:
+		whisper_status error_status;
+	public:
+		whisper_error(whisper_status status) : std::runtime_error(whisper_status_text(status)), error_status(status) {}
+		whisper_status status() const { return error_status; }
+	};
+
 	class whisper_engine
 	{
 	private:
 		fixed_metadata fixed_fields;
+		extended_metadata extended_fields;
 		filesystem::path datafilepath;
 		std::string filename;
 		filesystem::path infilepath;
@@ -104,7 +185,103 @@ namespace whisper
 		std::fstream infile;
 		std::fstream outfile;
 		std::fstream datafile;
+		block_reader media_reader;			// reads the carrier ahead of the source (see attach_media_input)
+		block_writer media_writer;			// writes the sink's blocks behind it
 		WavMetadata wav_metadata;
+		std::string wav_header;				// carrier bytes before the first sample, passed through unchanged
+		std::string probe_header;			// the same, as check_capacity reads it ahead
+		simd_level kernel_level;
+		kernel_set metadata_kernels;		// the fixed metadata always goes in one bit per sample
+		kernel_set kernels;					// filename and data
+		uint32_t selected_mask_factor;		// payload bits per eligible sample when encoding
+		uint32_t selected_threshold_factor;	// threshold for the payload when encoding; 0 picks one per carrier
+		histogram_kernel histogram_span;
+		wide_histogram_kernel histogram_wide;
+		sample_format carrier_format;		// any but sample_int16 is worked on in wide_samples
+		unpack_kernel unpack_samples;
+		pack_kernel pack_samples;
+		std::vector<int64_t> wide_samples;	// as int32_t or, for 64-bit floating point, int64_t
+		size_t thread_count;
+		parallel_runner runner;
+		std::vector<uint64_t> slice_eligible;
+		std::vector<uint64_t> slice_first_bit;
+		std::vector<std::vector<uint8_t>> slice_bytes;
+		io_mode selected_io_mode;
+		size_t io_block_bytes;
+		mapped_file infile_map;
+		mapped_file outfile_map;
+		sample_source source;
+		sample_sink sink;
+		aligned_buffer payload;
+		buffer_pool* buffers;				// where the I/O blocks come from; the heap if null
+		std::istream* in_musicstream;		// caller-supplied streams; nullptr selects the file path
+		std::ostream* out_musicstream;
+		std::istream* in_datastream;
+		std::ostream* out_datastream;
+		std::stringstream spooled_data;		// payload read ahead from a stream of unknown size
+		std::fstream spool_file;			// takes over from spooled_data past max_spooled_bytes
+		filesystem::path spool_path;
+		uint64_t spooled_bytes;
+		std::ostream* messages;				// status and error text, cout by default
+		output_claim claim_output;			// null allows every output path
+		whisper_status error_status;		// why the last call returning -1 failed
+		byte_span in_musicspan;				// caller-supplied memory, used in place of streams and paths
+		byte_span out_musicspan;
+		byte_span in_dataspan;
+		byte_span out_dataspan;
+		bool delta_output;					// encode to a delta against the carrier instead of a WAV
+		delta_writer delta;
+		null_streambuf discarded;
+		std::ostream discard_stream { &discarded };	// takes the encoded samples while a delta is written
+		engine_stats job_stats;				// filled in a stage at a time (see begin_stage)
+		stats_stage current_stage;			// stage_count between stages
+		std::chrono::steady_clock::time_point stage_start;
+		stage_stats stage_counters;			// io_counters() as the current stage began
+		uint64_t direct_bytes_read;			// payload and decoded data, and kernel copies, which bypass source and sink
+		uint64_t direct_bytes_written;
+		uint64_t direct_io_calls;
+
+		int failed(whisper_status status) { error_status = status; return -1; }
+		void check_output_claim(const filesystem::path& file_path);
+		bool parse_wav_chunks(sample_source& from, WavMetadata& metadata, std::string& header);
+		void remove_spool_file();
+		void clear_job_state();
+		void start_job_stats(bool encode);
+		stage_stats io_counters() const;
+		void begin_stage(stats_stage stage);	// ends the stage before it, if any
+		void end_stage();
+		void count_field(const kernel_set& set, size_t byte_count, uint64_t samples);
+		void set_carrier_format(const WavMetadata& metadata, sample_source& from);
+		size_t unpack_available(sample_source& from);
+		size_t extract_available(const kernel_set& set, sample_source& from, uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+		uint64_t count_available(sample_source& from);
+		size_t histogram_available(sample_source& from, uint64_t* at_least);
+		size_t metadata_bytes() const { return sizeof(fixed_metadata) + (fixed_fields.attribits.metadata_version ? sizeof(extended_metadata) : 0); }
+
+		std::istream& media_input() { return in_musicstream ? *in_musicstream : infile; }
+		std::istream& data_input() { return in_datastream ? *in_datastream : datafile; }
+		std::ostream& data_output() { return out_datastream ? *out_datastream : datafile; }
+		bool media_is_mappable() { return selected_io_mode == io_mapped && !delta_output && !in_musicstream && !out_musicstream && !in_musicspan.data && !out_musicspan.data; }
+		bool media_is_patchable() { return selected_io_mode == io_patched && !delta_output && !in_musicstream && !out_musicstream && !in_musicspan.data && !out_musicspan.data; }
+		bool media_reads_async() { return selected_io_mode == io_async && !in_musicstream && !in_musicspan.data; }
+		bool media_writes_async() { return selected_io_mode == io_async && !delta_output && !out_musicstream && !out_musicspan.data; }
+		bool attach_media_input(sample_source& to, block_reader& reader, std::istream& stream);
+		bool attach_media_output(sample_sink& to, block_writer& writer, std::ostream& stream);
+		bool media_in_place() { std::error_code error; return media_is_patchable() && filesystem::equivalent(infilepath, outfilepath, error); }
+
+		size_t parallel_slices(size_t count, uint64_t bits);
+		uint64_t count_samples(const int16_t* in, size_t count);
+		size_t plan_round(const kernel_set& set, const int16_t* in, size_t round, size_t slices,
+			uint64_t bit_index, uint64_t bit_count);
+		size_t embed_samples(const kernel_set& set, const int16_t* in, int16_t* out, size_t count,
+			const uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+		size_t extract_samples(const kernel_set& set, const int16_t* in, size_t count,
+			uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+		int embed_bytes(const kernel_set& set, const uint8_t* data, size_t byte_count);
+		int extract_bytes(const kernel_set& set, uint8_t* data, size_t byte_count);
+		size_t payload_block_bytes();
+		uint32_t payload_threshold_factor();
+		static uint64_t field_samples(const kernel_set& set, uint64_t byte_count);
 	public:
 		template<typename SAMPLE_TYPE_T>
 		void calc_threshold(SAMPLE_TYPE_T& threshold);
@@ -121,32 +298,66 @@ namespace whisper
 
 		whisper_engine()
 		{
-			fixed_fields = { { 'W','H','I','S','P','E','R' }, {0}, 0 };
-			fixed_fields.attribits.threshold_factor = 8;
-			fixed_fields.attribits.sample_bits_select = 1;
-			fixed_fields.attribits.skip_min_neg_sample_value = true;
-			wav_metadata = { 0 };
+			messages = &cout;
+			selected_mask_factor = 1;
+			selected_threshold_factor = default_threshold_factor;
+			kernel_level = detect_simd_level();
+			set_thread_count(0);
+			selected_io_mode = io_buffered;
+			io_block_bytes = default_io_block_bytes;
+			buffers = nullptr;
+			clear_job_state();
 		}
+		~whisper_engine() { remove_spool_file(); }
 		int encode_data();
 		int decode_data();
 		int open_files_for_decoding();
 		int open_files_for_encoding(); 
+		int open_files_for_analysis();
+		int check_capacity(uint64_t needed_samples);
+		int analyze_capacity(capacity_report& report);
+		uint64_t capacity_bytes(const capacity_report& report, uint32_t threshold_factor, uint32_t mask_factor);
+		static std::string threshold_text(sample_format format, uint32_t threshold_factor);
+		int report_capacity();
 		void close_files();
+		// Clears what a job leaves behind (paths, streams, spans, metadata, spooled data, the last
+		// error and delta output) for the next job, keeping the settings and whatever the engine
+		// has allocated, so that an engine can go from job to job the way engine_pool recycles it.
+		void reset();
 		fixed_metadata get_whisper_metadata();
 		void set_whisper_metadata(fixed_metadata whisper_fields);
-		ios_base::iostate  decode_whisper_metadata();
-		ios_base::iostate  decode_data_byte(uint8_t& data_byte);
-		ios_base::iostate decode_whisper_embedded_filename();
-		std::ios_base::fmtflags copy_wav_metadata();
-
-		std::ios_base::fmtflags write_whisper_metadata();
-		std::ios_base::fmtflags write_whisper_embedded_filename();
-
-		std::ios_base::fmtflags write_hidden_data();
-
-		std::ios_base::fmtflags write_single_hidden_datum(uint8_t* data, int32_t data_width);
-
-		std::ios_base::fmtflags decode_hidden_data();
+		uint64_t data_byte_count() const;
+		void set_data_byte_count(uint64_t byte_count);	// picks the metadata version that holds it
+		bool set_kernel_level(simd_level level);
+		bool set_mask_factor(uint32_t mask_factor);	// 1 to max_mask_factor payload bits per eligible sample
+		bool set_threshold_factor(uint32_t threshold_factor);	// 0 selects the highest that fits the payload
+		void set_thread_count(size_t threads);		// 0 selects one per hardware thread
+		size_t get_thread_count() const { return thread_count; }
+		void apply_settings(const whisper_engine& settings);	// kernels, factors and I/O mode, not threads
+		void set_message_stream(std::ostream& stream);
+		void set_buffer_pool(buffer_pool* pool);	// I/O blocks are given back to it as files close
+		void set_output_claim(const output_claim& claim) { claim_output = claim; }	// for this job only
+		whisper_status last_error() const { return error_status; }
+		const engine_stats& stats() const { return job_stats; }	// of the job opened last
+		void set_io_mode(io_mode mode);
+		io_mode get_io_mode() const { return selected_io_mode; }
+		void set_delta_output(bool enabled) { delta_output = enabled; }
+		int apply_delta(filesystem::path delta_path);	// rebuilds the encoded WAV at the out path from the in path
+		bool set_io_block_size(size_t block_bytes);
+		int decode_whisper_metadata();
+		int decode_data_byte(uint8_t& data_byte);
+		int decode_whisper_embedded_filename();
+		void validate_wav_metadata(const WavMetadata& wav_metadata);
+		int copy_wav_metadata();
+
+		int write_whisper_metadata();
+		int write_whisper_embedded_filename();
+
+		int write_hidden_data();
+
+		int write_single_hidden_datum(uint8_t* data, int32_t data_width);
+
+		int decode_hidden_data();
 
 		bool datafile_exists();
 
@@ -164,6 +375,31 @@ namespace whisper
 
 		bool set_out_musicpath(filesystem::path file_path);
 
+		// Streams are read and written strictly in order, so pipes work; the carrier is never
+		// probed ahead, and a payload stream is read ahead because its size goes first: into memory,
+		// then into a temporary file once it passes max_spooled_bytes.
+		bool set_in_musicstream(std::istream& stream);
+
+		bool set_out_musicstream(std::ostream& stream);
+
+		bool set_in_datastream(std::istream& stream, const std::string& name);
+
+		bool set_out_datastream(std::ostream& stream);
+
+		// Memory in place of files: the carrier and payload are used where they lie, the encoded
+		// WAV must fit in out_musicspan (see encoded_size) and the payload in out_dataspan.
+		bool set_in_musicspan(const void* data, size_t bytes);
+
+		bool set_out_musicspan(void* data, size_t bytes);
+
+		bool set_in_dataspan(const void* data, size_t bytes, const std::string& name);
+
+		bool set_out_dataspan(void* data, size_t bytes);
+
+		static size_t encoded_size(size_t carrier_bytes);
+
+		const std::string& decoded_name() { return filename; }
+
 		uint8_t data_mask_bit_count();
 
 		int64_t precision_mask();
@@ -174,9 +410,9 @@ namespace whisper
 
 		uint8_t sample_bits();
 
-		std::ios_base::fmtflags copy_remaining_samples(); // expects open files and does not close them
+		int copy_remaining_samples(); // expects open files and does not close them
 
-		std::ios_base::fmtflags read_wav_metadata(WavMetadata& wav_metadata);
+		int read_wav_metadata(WavMetadata& wav_metadata);
 
 	};
 
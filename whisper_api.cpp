@@ -0,0 +1,221 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_api.h"
+
+using namespace whisper;
+
+namespace
+{
+	// Adapts a read_callback to the istream the engine streams a carrier from.
+	class callback_istreambuf : public std::streambuf
+	{
+	private:
+		const read_callback& reader;
+		char last;
+	protected:
+		std::streamsize xsgetn(char* buffer, std::streamsize count) override
+		{
+			std::streamsize total = 0;
+
+			while (total < count)
+			{
+				size_t got = reader(buffer + total, (size_t)(count - total));
+				if (!got)
+					break;
+				total += (std::streamsize)got;
+			}
+			return total;
+		}
+
+		int_type underflow() override
+		{
+			if (!reader(&last, 1))
+				return traits_type::eof();
+			setg(&last, &last, &last + 1);
+			return traits_type::to_int_type(last);
+		}
+	public:
+		callback_istreambuf(const read_callback& read) : reader(read), last(0) {}
+	};
+
+	// Adapts a write_callback to the ostream the engine writes blocks to.
+	class callback_ostreambuf : public std::streambuf
+	{
+	private:
+		const write_callback& writer;
+	protected:
+		std::streamsize xsputn(const char* buffer, std::streamsize count) override
+		{
+			return writer(buffer, (size_t)count) ? count : 0;
+		}
+
+		int_type overflow(int_type value) override
+		{
+			char byte = traits_type::to_char_type(value);
+
+			if (traits_type::eq_int_type(value, traits_type::eof()))
+				return traits_type::not_eof(value);
+			return writer(&byte, 1) ? value : traits_type::eof();
+		}
+	public:
+		callback_ostreambuf(const write_callback& write) : writer(write) {}
+	};
+
+	// Leased engines keep the settings of their last call, so every one the options cover is set,
+	// and one the engine refuses fails the call rather than leaving another in its place. Each call
+	// leases its engine after the streams it hands it, so that the engine is reset and back in the
+	// pool before they go.
+	void configure(whisper_engine& engine, const whisper_options& options, std::ostream& discard)
+	{
+		engine.set_message_stream(options.messages ? *options.messages : discard);
+		engine.set_thread_count(options.thread_count);
+		if (!engine.set_kernel_level(options.kernel_level) || !engine.set_io_block_size(options.io_block_bytes))
+			throw whisper_error(whisper_invalid_argument);
+	}
+
+	template<typename CALL_T>
+	whisper_status run_call(whisper_engine& engine, CALL_T call)
+	{
+		try
+		{
+			whisper_status status = call() ? engine.last_error() : whisper_ok;
+			engine.close_files();
+			return status;
+		}
+		catch (const whisper_error& error)
+		{
+			engine.close_files();
+			return error.status();
+		}
+		catch (const std::bad_alloc&)
+		{
+			engine.close_files();
+			return whisper_out_of_memory;
+		}
+	}
+}
+
+whisper_options whisper::whisper_default_options()
+{
+	return { detect_simd_level(), 1, 1, default_threshold_factor, default_io_block_bytes, nullptr };
+}
+
+void whisper::whisper_pool_statistics(pool_stats& blocks, engine_pool_stats& engines)
+{
+	blocks = shared_buffer_pool().stats();
+	engines = shared_engine_pool().stats();
+}
+
+void whisper::whisper_set_pool_limits(size_t free_block_bytes, size_t idle_engines, bool huge_pages)
+{
+	shared_buffer_pool().set_limit(free_block_bytes);
+	shared_buffer_pool().set_huge_pages(huge_pages);
+	shared_engine_pool().set_limit(idle_engines);
+}
+
+size_t whisper::whisper_encoded_size(size_t carrier_bytes)
+{
+	return whisper_engine::encoded_size(carrier_bytes);
+}
+
+whisper_status whisper::whisper_encode(const void* carrier, size_t carrier_bytes,
+	const void* data, size_t data_bytes, const std::string& data_name,
+	void* out, size_t out_bytes, const whisper_options& options)
+{
+	std::ostream discard(nullptr);
+	engine_lease lease(shared_engine_pool());
+	whisper_engine& engine = *lease;
+
+	return run_call(engine, [&]
+	{
+		configure(engine, options, discard);
+		engine.set_in_musicspan(carrier, carrier_bytes);
+		if (!engine.set_mask_factor(options.mask_factor) || !engine.set_threshold_factor(options.threshold_factor))
+			throw whisper_error(whisper_invalid_argument);
+		engine.set_in_dataspan(data, data_bytes, data_name);
+		engine.set_out_musicspan(out, out_bytes);
+		return engine.open_files_for_encoding() || engine.encode_data();
+	});
+}
+
+whisper_status whisper::whisper_encode(const read_callback& carrier,
+	const void* data, size_t data_bytes, const std::string& data_name,
+	const write_callback& out, const whisper_options& options)
+{
+	std::ostream discard(nullptr);
+	callback_istreambuf carrier_buffer(carrier);
+	callback_ostreambuf out_buffer(out);
+	std::istream carrier_stream(&carrier_buffer);
+	std::ostream out_stream(&out_buffer);
+	engine_lease lease(shared_engine_pool());
+	whisper_engine& engine = *lease;
+
+	return run_call(engine, [&]
+	{
+		configure(engine, options, discard);
+		engine.set_in_musicstream(carrier_stream);
+		if (!engine.set_mask_factor(options.mask_factor) || !engine.set_threshold_factor(options.threshold_factor))
+			throw whisper_error(whisper_invalid_argument);
+		engine.set_in_dataspan(data, data_bytes, data_name);
+		engine.set_out_musicstream(out_stream);
+		return engine.open_files_for_encoding() || engine.encode_data();
+	});
+}
+
+whisper_status whisper::whisper_decode(const void* carrier, size_t carrier_bytes,
+	void* data, size_t& data_bytes, std::string& data_name, const whisper_options& options)
+{
+	std::ostream discard(nullptr);
+	char no_space = 0;
+	engine_lease lease(shared_engine_pool());
+	whisper_engine& engine = *lease;
+
+	whisper_status status = run_call(engine, [&]
+	{
+		configure(engine, options, discard);
+		engine.set_in_musicspan(carrier, carrier_bytes);
+		engine.set_out_dataspan(data ? data : &no_space, data ? data_bytes : 0);
+		return engine.open_files_for_decoding() || engine.decode_data();
+	});
+
+	if (status == whisper_ok || status == whisper_buffer_too_small)
+	{
+		// with a 32-bit size_t, hidden data of 4 GB or more cannot be held in memory at all
+		uint64_t byte_count = engine.data_byte_count();
+		data_bytes = byte_count > SIZE_MAX ? SIZE_MAX : (size_t)byte_count;
+		data_name = engine.decoded_name();
+	}
+	return status;
+}
+
+whisper_status whisper::whisper_decode(const read_callback& carrier, const write_callback& data,
+	std::string& data_name, const whisper_options& options)
+{
+	std::ostream discard(nullptr);
+	callback_istreambuf carrier_buffer(carrier);
+	callback_ostreambuf data_buffer(data);
+	std::istream carrier_stream(&carrier_buffer);
+	std::ostream data_stream(&data_buffer);
+	engine_lease lease(shared_engine_pool());
+	whisper_engine& engine = *lease;
+
+	whisper_status status = run_call(engine, [&]
+	{
+		configure(engine, options, discard);
+		engine.set_in_musicstream(carrier_stream);
+		engine.set_out_datastream(data_stream);
+		return engine.open_files_for_decoding() || engine.decode_data();
+	});
+
+	if (status == whisper_ok)
+		data_name = engine.decoded_name();
+	return status;
+}
@@ -0,0 +1,66 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include "whisper.h"
+#include "whisper_pool.h"
+
+#include <functional>
+
+// In-process interface for services: each call runs on its own engine, touches no files, writes
+// nothing to the console unless asked, and reports failure as a whisper_status rather than
+// ending the process. Calls may run concurrently from any number of threads.
+namespace whisper
+{
+	// Reads up to count bytes into buffer and returns how many were read; 0 ends the input.
+	typedef std::function<size_t(char* buffer, size_t count)> read_callback;
+
+	// Consumes count bytes from buffer; returning false stops the call with whisper_write_error.
+	typedef std::function<bool(const char* buffer, size_t count)> write_callback;
+
+	typedef struct whisper_options
+	{
+		simd_level kernel_level;		// best supported by default; one this processor lacks is refused
+		size_t thread_count;			// 1 by default, leaving concurrency to the caller
+		uint32_t mask_factor;			// data bits per eligible sample when encoding, 1 to max_mask_factor
+		uint32_t threshold_factor;		// encode in samples of at least 1 << threshold_factor; 0 picks the highest that fits
+		size_t io_block_bytes;			// block size for callback I/O, min_io_block_bytes to max_io_block_bytes
+		std::ostream* messages;			// status text; nullptr, the default, discards it
+	} whisper_options;
+
+	whisper_options whisper_default_options();
+
+	// Calls lease their engines from shared_engine_pool() and their I/O blocks from
+	// shared_buffer_pool(), so that a steady stream of calls runs on the ones before it.
+	void whisper_pool_statistics(pool_stats& blocks, engine_pool_stats& engines);
+	void whisper_set_pool_limits(size_t free_block_bytes, size_t idle_engines, bool huge_pages);
+
+	// Size of the encoded WAV for a carrier of carrier_bytes; out_bytes must be at least this.
+	size_t whisper_encoded_size(size_t carrier_bytes);
+
+	whisper_status whisper_encode(const void* carrier, size_t carrier_bytes,
+		const void* data, size_t data_bytes, const std::string& data_name,
+		void* out, size_t out_bytes, const whisper_options& options = whisper_default_options());
+
+	whisper_status whisper_encode(const read_callback& carrier,
+		const void* data, size_t data_bytes, const std::string& data_name,
+		const write_callback& out, const whisper_options& options = whisper_default_options());
+
+	// data_bytes is the space at data on entry and the size of the hidden data on return, also
+	// when the result is whisper_buffer_too_small, so a call with no space finds the size needed.
+	// Hidden data too large for a size_t at all is reported as SIZE_MAX bytes.
+	whisper_status whisper_decode(const void* carrier, size_t carrier_bytes,
+		void* data, size_t& data_bytes, std::string& data_name,
+		const whisper_options& options = whisper_default_options());
+
+	whisper_status whisper_decode(const read_callback& carrier, const write_callback& data,
+		std::string& data_name, const whisper_options& options = whisper_default_options());
+}
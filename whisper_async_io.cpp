@@ -0,0 +1,687 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_async_io.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define WHISPER_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+#endif
+
+using namespace whisper;
+
+const char* whisper::io_queue_backend_name(io_queue_backend backend)
+{
+	switch (backend)
+	{
+	case io_queue_uring:
+		return "io_uring";
+	case io_queue_thread:
+		return "thread";
+	case io_queue_stage:
+		return "stage";
+	default:
+		return "none";
+	}
+}
+
+io_queue::io_queue()
+	: submitted(0), reaped(0), kind(io_queue_closed), writing(false), finished(0), stopping(false),
+	fd(-1), ring_fd(-1), sq_ring(nullptr), cq_ring(nullptr), sqes(nullptr), sq_ring_bytes(0), cq_ring_bytes(0), sqe_bytes(0),
+	sq_head(nullptr), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr), cq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr), cqes(nullptr)
+{
+}
+
+bool io_queue::open(const std::filesystem::path& file_path, bool writable, size_t depth, bool allow_uring)
+{
+	close();
+	requests.assign(std::clamp<size_t>(depth, 1, max_io_queue_depth), io_request());
+	writing = writable;
+	submitted = 0;
+	reaped = 0;
+	finished = 0;
+	stopping = false;
+
+	if (allow_uring && open_uring(file_path, requests.size()))
+	{
+		kind = io_queue_uring;
+		return true;
+	}
+
+	file.open(file_path, writable ? std::ios::binary | std::ios::in | std::ios::out : std::ios::binary | std::ios::in);
+	if (!file.is_open())
+	{
+		requests.clear();
+		return false;
+	}
+	kind = io_queue_thread;
+	worker = std::thread(&io_queue::worker_loop, this);
+	return true;
+}
+
+void io_queue::close()
+{
+	if (kind == io_queue_uring)
+	{
+		while (in_flight())
+			complete();
+		close_uring();
+	}
+	else if (kind == io_queue_thread)
+	{
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		worker.join();
+		file.close();
+	}
+	kind = io_queue_closed;
+	requests.clear();
+	submitted = 0;
+	reaped = 0;
+}
+
+bool io_queue::submit(char* data, size_t size, uint64_t offset)
+{
+	if (kind == io_queue_closed || in_flight() >= requests.size())
+		return false;
+
+	io_request& request = requests[submitted % requests.size()];
+	request.data = data;
+	request.size = size;
+	request.offset = offset;
+	request.result = -1;
+	request.done = false;
+
+	if (kind == io_queue_uring)
+	{
+		if (!submit_uring(request, submitted))
+			return false;
+		submitted++;
+		return true;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		submitted++;
+	}
+	wake.notify_one();
+	return true;
+}
+
+int64_t io_queue::complete()
+{
+	if (!in_flight())
+		return -1;
+
+	io_request& request = requests[reaped % requests.size()];
+
+	if (kind == io_queue_uring)
+	{
+		while (!request.done)
+		{
+			if (!reap_uring())
+			{
+				request.result = -1;
+				request.done = true;
+			}
+		}
+		finish_transfer(request);
+	}
+	else
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		done.wait(guard, [this] { return finished > reaped; });
+	}
+	reaped++;
+	return request.result;
+}
+
+// Requests are taken in order, each one seeking to its own offset, so the file is read or
+// written sequentially while the caller works on other blocks.
+void io_queue::worker_loop()
+{
+	for (;;)
+	{
+		uint64_t index = 0;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [this] { return stopping || finished < submitted; });
+			if (finished == submitted)
+				return;
+			index = finished;
+		}
+
+		io_request& request = requests[index % requests.size()];
+		if (writing)
+		{
+			file.seekp((std::streamoff)request.offset).write(request.data, (std::streamsize)request.size).flush();
+			request.result = file.good() ? (int64_t)request.size : -1;
+		}
+		else
+		{
+			file.seekg((std::streamoff)request.offset).read(request.data, (std::streamsize)request.size);
+			request.result = file.bad() ? -1 : (int64_t)file.gcount();
+		}
+		file.clear();
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			finished++;
+		}
+		done.notify_all();
+	}
+}
+
+#ifdef WHISPER_URING
+
+// The rings are shared with the kernel: it moves the submission queue head and the completion
+// queue tail, and reads what is between them only after the tail or head this side moves.
+bool io_queue::open_uring(const std::filesystem::path& file_path, size_t depth)
+{
+	io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	fd = ::open(file_path.c_str(), (writing ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	ring_fd = (int)syscall(__NR_io_uring_setup, (unsigned)depth, &params);
+	if (ring_fd < 0)
+	{
+		close_uring();	// not built into this kernel, or not allowed here
+		return false;
+	}
+
+	sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+	sqe_bytes = params.sq_entries * sizeof(io_uring_sqe);
+
+	sq_ring = mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		sq_ring = nullptr;
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring = sq_ring;
+	else if ((cq_ring = mmap(nullptr, cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+		cq_ring = nullptr;
+	if ((sqes = mmap(nullptr, sqe_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES)) == MAP_FAILED)
+		sqes = nullptr;
+	if (!sq_ring || !cq_ring || !sqes)
+	{
+		close_uring();
+		return false;
+	}
+
+	char* sq = (char*)sq_ring;
+	char* cq = (char*)cq_ring;
+	sq_head = (uint32_t*)(sq + params.sq_off.head);
+	sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+	sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+	sq_array = (uint32_t*)(sq + params.sq_off.array);
+	cq_head = (uint32_t*)(cq + params.cq_off.head);
+	cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+	cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+	return true;
+}
+
+void io_queue::close_uring()
+{
+	if (sqes)
+		munmap(sqes, sqe_bytes);
+	if (cq_ring && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_bytes);
+	if (sq_ring)
+		munmap(sq_ring, sq_ring_bytes);
+	if (ring_fd >= 0)
+		::close(ring_fd);
+	if (fd >= 0)
+		::close(fd);
+	sqes = nullptr;
+	cq_ring = nullptr;
+	sq_ring = nullptr;
+	ring_fd = -1;
+	fd = -1;
+}
+
+// Readv and writev rather than read and write, which kernels before 5.6 lack.
+bool io_queue::submit_uring(io_request& request, uint64_t index)
+{
+	uint32_t tail = *sq_tail;
+	uint32_t slot = tail & *sq_mask;
+	io_uring_sqe* sqe = (io_uring_sqe*)sqes + slot;
+	iovec* vector = (iovec*)request.vector;
+
+	vector->iov_base = request.data;
+	vector->iov_len = request.size;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = request.offset;
+	sqe->addr = (uint64_t)(uintptr_t)vector;
+	sqe->len = 1;
+	sqe->user_data = index;
+	sq_array[slot] = slot;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	for (;;)
+	{
+		int entered = (int)syscall(__NR_io_uring_enter, ring_fd, 1u, 0u, 0u, nullptr, (size_t)0);
+		if (entered >= 0 || errno != EINTR)
+			return entered == 1;
+	}
+}
+
+// Marks whatever has completed, waiting for at least one completion if none has.
+bool io_queue::reap_uring()
+{
+	for (;;)
+	{
+		uint32_t head = *cq_head;
+		uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head != tail)
+		{
+			for (; head != tail; head++)
+			{
+				const io_uring_cqe* cqe = (const io_uring_cqe*)cqes + (head & *cq_mask);
+				io_request& request = requests[cqe->user_data % requests.size()];
+				request.result = cqe->res;
+				request.done = true;
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+			return true;
+		}
+
+		int entered = (int)syscall(__NR_io_uring_enter, ring_fd, 0u, 1u, (unsigned)IORING_ENTER_GETEVENTS, nullptr, (size_t)0);
+		if (entered < 0 && errno != EINTR)
+			return false;
+	}
+}
+
+// A transfer may stop short, as a read does at the end of the file; the rest is finished here.
+void io_queue::finish_transfer(io_request& request)
+{
+	if (request.result < 0)
+	{
+		request.result = -1;
+		return;
+	}
+
+	while ((size_t)request.result < request.size)
+	{
+		char* data = request.data + request.result;
+		size_t size = request.size - (size_t)request.result;
+		off_t offset = (off_t)(request.offset + (uint64_t)request.result);
+		ssize_t moved = writing ? pwrite(fd, data, size, offset) : pread(fd, data, size, offset);
+
+		if (moved < 0 && errno == EINTR)
+			continue;
+		if (moved < 0 || (moved == 0 && writing))
+		{
+			request.result = -1;
+			return;
+		}
+		if (moved == 0)
+			return;		// end of file
+		request.result += moved;
+	}
+}
+
+#else
+
+bool io_queue::open_uring(const std::filesystem::path&, size_t)
+{
+	return false;
+}
+
+void io_queue::close_uring()
+{
+}
+
+bool io_queue::submit_uring(io_request&, uint64_t)
+{
+	return false;
+}
+
+bool io_queue::reap_uring()
+{
+	return false;
+}
+
+void io_queue::finish_transfer(io_request&)
+{
+}
+
+#endif
+
+// The slack goes in front of each block, which keeps the block itself aligned.
+bool block_reader::allocate_blocks(size_t depth)
+{
+	for (size_t index = 0; index < depth; index++)
+	{
+		blocks.push_back(std::make_unique<aligned_buffer>());
+		blocks.back()->set_pool(pool);
+		if (!blocks.back()->allocate(io_block_alignment + block_bytes))
+		{
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool block_reader::open(const std::filesystem::path& file_path, size_t block_size, size_t depth, bool allow_uring)
+{
+	std::error_code error;
+
+	close();
+	block_bytes = std::clamp(block_size, min_io_block_bytes, max_io_block_bytes);
+	file_bytes = std::filesystem::file_size(file_path, error);
+	if (error || !queue.open(file_path, false, depth, allow_uring) || !allocate_blocks(queue.depth()))
+		return false;
+
+	next_offset = 0;
+	next_block = 0;
+	held = blocks.size();
+	read_failed = false;
+	for (size_t index = 0; index < blocks.size(); index++)
+		queue_block(index);
+	return !read_failed;
+}
+
+bool block_reader::open(std::istream& from, size_t block_size, size_t depth)
+{
+	close();
+	block_bytes = std::clamp(block_size, min_io_block_bytes, max_io_block_bytes);
+	if (!allocate_blocks(std::clamp<size_t>(depth, 2, max_io_queue_depth)))
+		return false;
+
+	filled.reset(blocks.size());
+	emptied.reset(blocks.size());
+	for (size_t index = 0; index < blocks.size(); index++)
+		emptied.try_push(index);
+	held = blocks.size();
+	read_failed = false;
+	ended = false;
+	stopping.store(false, std::memory_order_relaxed);
+	stream = &from;
+	stage = std::thread(&block_reader::stage_loop, this);
+	return true;
+}
+
+// Every block the thread takes goes back to the consumer, the last one marking the end of the
+// stream or a read error, after which the thread leaves the stream alone.
+void block_reader::stage_loop()
+{
+	for (;;)
+	{
+		block_ticket ticket = { 0, 0 };
+		unsigned spins = 0;
+
+		while (!emptied.try_pop(ticket.block))
+		{
+			if (stopping.load(std::memory_order_acquire))
+				return;
+			backoff(spins);
+		}
+
+		stream->read(blocks[ticket.block]->data() + io_block_alignment, (std::streamsize)block_bytes);
+		ticket.bytes = stream->bad() ? -1 : (int64_t)stream->gcount();
+		filled.try_push(ticket);	// never full, with as many slots as blocks
+		if (ticket.bytes <= 0 || stopping.load(std::memory_order_acquire))
+			return;
+	}
+}
+
+void block_reader::close()
+{
+	stopping.store(true, std::memory_order_release);
+	if (stage.joinable())
+		stage.join();
+	stream = nullptr;
+	queue.close();
+	blocks.clear();
+	held = 0;
+}
+
+bool block_reader::queue_block(size_t index)
+{
+	if (next_offset >= file_bytes)
+		return false;
+
+	size_t size = (size_t)std::min<uint64_t>(block_bytes, file_bytes - next_offset);
+	if (!queue.submit(blocks[index]->data() + io_block_alignment, size, next_offset))
+	{
+		read_failed = true;
+		return false;
+	}
+	next_offset += size;
+	return true;
+}
+
+const char* block_reader::next(const char* carry, size_t carry_bytes, size_t& count)
+{
+	char carried[block_slack];
+
+	count = 0;
+	if (read_failed || carry_bytes > block_slack)
+		return nullptr;
+	if (carry_bytes)
+		memcpy(carried, carry, carry_bytes);
+
+	if (stream)
+	{
+		size_t index = held;
+		if (!ended)
+		{
+			block_ticket ticket = { 0, 0 };
+			unsigned spins = 0;
+
+			if (held < blocks.size())
+				emptied.try_push(held);
+			while (!filled.try_pop(ticket))
+				backoff(spins);
+			index = held = ticket.block;
+			ended = ticket.bytes <= 0;
+			if (ticket.bytes < 0)
+			{
+				read_failed = true;
+				return nullptr;
+			}
+			count = (size_t)ticket.bytes;
+		}
+
+		char* front = blocks[index]->data() + io_block_alignment - carry_bytes;
+		if (carry_bytes)
+			memcpy(front, carried, carry_bytes);
+		count += carry_bytes;
+		return front;
+	}
+
+	// the block handed out before goes to the back of the queue, unless the file is all queued
+	size_t index = held < blocks.size() ? held : 0;
+	if (held < blocks.size())
+		queue_block(held);
+
+	if (queue.in_flight())
+	{
+		int64_t result = queue.complete();
+		index = next_block;
+		next_block = (next_block + 1) % blocks.size();
+		held = index;
+		if (result < 0)
+		{
+			read_failed = true;
+			return nullptr;
+		}
+		count = (size_t)result;
+	}
+
+	char* front = blocks[index]->data() + io_block_alignment - carry_bytes;
+	if (carry_bytes)
+		memcpy(front, carried, carry_bytes);
+	count += carry_bytes;
+	return front;
+}
+
+bool block_writer::allocate_blocks(size_t depth)
+{
+	for (size_t index = 0; index < depth; index++)
+	{
+		blocks.push_back(std::make_unique<aligned_buffer>());
+		blocks.back()->set_pool(pool);
+		if (!blocks.back()->allocate(block_bytes))
+		{
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool block_writer::open(const std::filesystem::path& file_path, uint64_t offset, size_t block_size, size_t depth, bool allow_uring)
+{
+	close();
+	block_bytes = std::clamp(block_size, min_io_block_bytes, max_io_block_bytes);
+	if (!queue.open(file_path, true, depth, allow_uring) || !allocate_blocks(queue.depth()))
+		return false;
+
+	next_offset = offset;
+	current = 0;
+	write_failed = false;
+	return true;
+}
+
+bool block_writer::open(std::ostream& to, size_t block_size, size_t depth)
+{
+	close();
+	block_bytes = std::clamp(block_size, min_io_block_bytes, max_io_block_bytes);
+	if (!allocate_blocks(std::clamp<size_t>(depth, 2, max_io_queue_depth)))
+		return false;
+
+	filled.reset(blocks.size());
+	emptied.reset(blocks.size());
+	for (size_t index = 1; index < blocks.size(); index++)
+		emptied.try_push(index);
+	current = 0;
+	write_failed = false;
+	submitted = 0;
+	written.store(0, std::memory_order_relaxed);
+	stage_failed.store(false, std::memory_order_relaxed);
+	stopping.store(false, std::memory_order_relaxed);
+	stream = &to;
+	stage = std::thread(&block_writer::stage_loop, this);
+	return true;
+}
+
+// After a failed write, blocks are still taken and returned, unwritten, so that the consumer
+// never waits on one.
+void block_writer::stage_loop()
+{
+	for (;;)
+	{
+		block_ticket ticket = { 0, 0 };
+		unsigned spins = 0;
+
+		while (!filled.try_pop(ticket))
+		{
+			if (stopping.load(std::memory_order_acquire))
+				return;
+			backoff(spins);
+		}
+
+		if (!stage_failed.load(std::memory_order_relaxed) && !stream->write(blocks[ticket.block]->data(), (std::streamsize)ticket.bytes))
+			stage_failed.store(true, std::memory_order_release);
+		emptied.try_push(ticket.block);
+		written.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void block_writer::close()
+{
+	if (stream)
+	{
+		drain();
+		stopping.store(true, std::memory_order_release);
+		stage.join();
+		stream = nullptr;
+	}
+	queue.close();
+	blocks.clear();
+	current = 0;
+}
+
+bool block_writer::take_result()
+{
+	if (queue.complete() < 0)
+		write_failed = true;
+	return !write_failed;
+}
+
+// The block after the one submitted is the oldest one written, so with every block in flight
+// its write is waited for before it is filled again.
+bool block_writer::submit(size_t count)
+{
+	if (failed() || !count)
+		return !failed();
+
+	if (stream)
+	{
+		unsigned spins = 0;
+
+		filled.try_push({ current, (int64_t)count });	// never full, with as many slots as blocks
+		submitted++;
+		while (!emptied.try_pop(current))
+			backoff(spins);
+		return !failed();
+	}
+
+	if (!queue.submit(block(), count, next_offset))
+	{
+		write_failed = true;
+		return false;
+	}
+	next_offset += count;
+	current = (current + 1) % blocks.size();
+	if (queue.in_flight() == blocks.size())
+		take_result();
+	return !write_failed;
+}
+
+bool block_writer::drain()
+{
+	if (stream)
+	{
+		unsigned spins = 0;
+
+		while (written.load(std::memory_order_acquire) != submitted)
+			backoff(spins);
+		return stream->flush() && !failed();
+	}
+
+	while (queue.in_flight())
+		take_result();
+	return !write_failed;
+}
@@ -0,0 +1,216 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include "whisper_io.h"
+#include "whisper_threads.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <atomic>
+
+namespace whisper
+{
+	const size_t default_io_queue_depth = 4;
+	const size_t max_io_queue_depth = 64;
+
+	enum io_queue_backend
+	{
+		io_queue_closed,
+		io_queue_uring,		// Linux io_uring, through its system calls
+		io_queue_thread,	// an I/O thread working through the requests in turn
+		io_queue_stage		// a reader or writer thread of its own on a stream, passing blocks through spsc_rings
+	};
+
+	typedef struct block_ticket
+	{
+		size_t block;
+		int64_t bytes;		// in the block; for a reader, 0 at the end of the stream and -1 on error
+	} block_ticket;
+
+	// Positional reads or writes of one file, with up to depth of them in flight at once and their
+	// results taken back in the order they were submitted. A result is the number of bytes moved,
+	// short of the size asked for only at the end of the file, or -1 on error.
+	class io_queue
+	{
+	private:
+		typedef struct io_request
+		{
+			char* data;
+			size_t size;
+			uint64_t offset;
+			int64_t result;
+			bool done;
+			uint64_t vector[2];		// the iovec io_uring takes the buffer from
+		} io_request;
+
+		std::vector<io_request> requests;	// ring of depth, in submission order
+		uint64_t submitted;
+		uint64_t reaped;
+		io_queue_backend kind;
+		bool writing;
+
+		// I/O thread
+		std::fstream file;
+		std::thread worker;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable done;
+		uint64_t finished;
+		bool stopping;
+
+		// io_uring
+		int fd;
+		int ring_fd;
+		void* sq_ring;
+		void* cq_ring;
+		void* sqes;
+		size_t sq_ring_bytes;
+		size_t cq_ring_bytes;
+		size_t sqe_bytes;
+		uint32_t* sq_head;
+		uint32_t* sq_tail;
+		uint32_t* sq_mask;
+		uint32_t* sq_array;
+		uint32_t* cq_head;
+		uint32_t* cq_tail;
+		uint32_t* cq_mask;
+		void* cqes;
+
+		bool open_uring(const std::filesystem::path& file_path, size_t depth);
+		void close_uring();
+		bool submit_uring(io_request& request, uint64_t index);
+		bool reap_uring();
+		void finish_transfer(io_request& request);
+		void worker_loop();
+	public:
+		io_queue();
+		~io_queue() { close(); }
+		io_queue(const io_queue&) = delete;
+		io_queue& operator=(const io_queue&) = delete;
+
+		// allow_uring false keeps to the I/O thread
+		bool open(const std::filesystem::path& file_path, bool writable, size_t depth, bool allow_uring = true);
+		void close();									// waits for whatever is in flight
+		io_queue_backend backend() const { return kind; }
+		size_t depth() const { return requests.size(); }
+		size_t in_flight() const { return (size_t)(submitted - reaped); }
+
+		bool submit(char* data, size_t size, uint64_t offset);	// false if depth requests are in flight
+		int64_t complete();							// waits for the oldest request in flight
+	};
+
+	// Reads a file from its start in blocks, keeping the reads of the blocks after the one handed
+	// out in flight, or reads a stream on a thread of its own, which fills free blocks from a pool
+	// as long as there are any and passes them on in order. Each block has block_slack bytes of
+	// room in front of it, so that the part of a sample left at the end of one block can be
+	// carried over to the front of the next.
+	class block_reader
+	{
+	private:
+		io_queue queue;
+		std::vector<std::unique_ptr<aligned_buffer>> blocks;
+		size_t block_bytes;
+		uint64_t file_bytes;
+		uint64_t next_offset;	// of the next block to be queued
+		size_t next_block;		// the next block to be handed out
+		size_t held;			// the block handed out last, or blocks.size()
+		bool read_failed;
+		buffer_pool* pool;		// blocks come from and go back to it, if set
+
+		// stream reader thread
+		std::istream* stream;
+		std::thread stage;
+		spsc_ring<block_ticket> filled;		// reader thread to consumer
+		spsc_ring<size_t> emptied;			// consumer to reader thread
+		std::atomic<bool> stopping;
+		bool ended;							// the reader thread has passed on its last block
+
+		bool allocate_blocks(size_t depth);
+		bool queue_block(size_t index);
+		void stage_loop();
+	public:
+		static const size_t block_slack = 64;
+
+		block_reader() : block_bytes(0), file_bytes(0), next_offset(0), next_block(0), held(0), read_failed(false), pool(nullptr),
+			stream(nullptr), stopping(false), ended(false) {}
+		~block_reader() { close(); }
+
+		bool open(const std::filesystem::path& file_path, size_t block_bytes, size_t depth, bool allow_uring = true);
+		bool open(std::istream& from, size_t block_bytes, size_t depth);
+		void close();
+		void set_pool(buffer_pool* from) { pool = from; }	// for the blocks of the next open
+		bool is_open() const { return !blocks.empty(); }
+		bool failed() const { return read_failed; }
+		io_queue_backend backend() const { return stream ? io_queue_stage : queue.backend(); }
+
+		// Hands out the next block, with the carry_bytes at carry, at most block_slack, moved in front
+		// of it; carry may point into the block handed out before, which is reused. Returns the start
+		// of the carried bytes, with count set to the bytes from there, no more than the carried ones
+		// at the end of the file, or null on a read error.
+		const char* next(const char* carry, size_t carry_bytes, size_t& count);
+	};
+
+	// Writes a file from a given offset in blocks filled in turn, keeping the writes of the blocks
+	// before the one being filled in flight, or hands the blocks to a thread of its own that
+	// writes them to a stream in order and returns them to the pool.
+	class block_writer
+	{
+	private:
+		io_queue queue;
+		std::vector<std::unique_ptr<aligned_buffer>> blocks;
+		size_t block_bytes;
+		uint64_t next_offset;	// of the block being filled
+		size_t current;			// the block being filled
+		bool write_failed;
+		buffer_pool* pool;
+
+		// stream writer thread
+		std::ostream* stream;
+		std::thread stage;
+		spsc_ring<block_ticket> filled;		// consumer to writer thread
+		spsc_ring<size_t> emptied;			// writer thread to consumer
+		std::atomic<bool> stopping;
+		std::atomic<bool> stage_failed;
+		uint64_t submitted;
+		std::atomic<uint64_t> written;
+
+		bool allocate_blocks(size_t depth);
+		bool take_result();
+		void stage_loop();
+	public:
+		block_writer() : block_bytes(0), next_offset(0), current(0), write_failed(false), pool(nullptr),
+			stream(nullptr), stopping(false), stage_failed(false), submitted(0), written(0) {}
+		~block_writer() { close(); }
+
+		bool open(const std::filesystem::path& file_path, uint64_t offset, size_t block_bytes, size_t depth, bool allow_uring = true);
+		bool open(std::ostream& to, size_t block_bytes, size_t depth);
+		void set_pool(buffer_pool* from) { pool = from; }
+		void close();		// waits for the writes in flight; drain() first to see how they went
+		bool is_open() const { return !blocks.empty(); }
+		bool failed() const { return write_failed || stage_failed.load(std::memory_order_acquire); }
+		io_queue_backend backend() const { return stream ? io_queue_stage : queue.backend(); }
+
+		char* block() { return blocks[current]->data(); }
+		size_t size() const { return block_bytes; }
+		bool submit(size_t count);		// queues count bytes of block() and moves on to the next one
+		bool drain();					// waits for every write in flight; false if any failed
+	};
+
+	const char* io_queue_backend_name(io_queue_backend backend);
+}
@@ -0,0 +1,282 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_batch.h"
+#include "whisper_pool.h"
+
+#include <chrono>
+
+using namespace whisper;
+
+static std::vector<std::string> split_fields(const std::string& line)
+{
+	std::vector<std::string> fields;
+	size_t begin = 0;
+
+	for (;;)
+	{
+		size_t end = line.find('\t', begin);
+		fields.push_back(line.substr(begin, end - begin));
+		if (end == std::string::npos)
+			return fields;
+		begin = end + 1;
+	}
+}
+
+static std::vector<path> regular_files(const path& dir)
+{
+	std::vector<path> files;
+
+	for (const auto& entry : directory_iterator(dir))
+	{
+		if (entry.is_regular_file())
+			files.push_back(entry.path());
+	}
+	sort(files.begin(), files.end());
+	return files;
+}
+
+bool whisper::read_batch_manifest(const path& manifest_path, std::vector<batch_job>& jobs)
+{
+	std::ifstream manifest(manifest_path);
+	std::string line;
+	size_t line_number = 0;
+
+	if (!manifest)
+	{
+		cout << "Could not open batch manifest: " << manifest_path.string() << endl;
+		return false;
+	}
+
+	while (getline(manifest, line))
+	{
+		line_number++;
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::vector<std::string> fields = split_fields(line);
+
+		if (fields[0] == "encode" && fields.size() == 4)
+			jobs.push_back({ ENCODE, path(fields[1]), path(fields[2]), path(fields[3]) });
+		else if (fields[0] == "decode" && fields.size() == 3)
+			jobs.push_back({ DECODE, path(fields[2]), path(fields[1]), path() });
+		else
+		{
+			cout << manifest_path.string() << ":" << line_number << ": expected encode with 3 paths or decode with 2, separated by tabs" << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool whisper::list_batch_encode_jobs(const path& data_dir, const path& music_in_dir,
+	const path& music_out_dir, std::vector<batch_job>& jobs)
+{
+	std::error_code error;
+
+	if (!is_directory(data_dir) || !is_directory(music_in_dir))
+	{
+		cout << "Batch input directories not found: " << data_dir.string() << ", " << music_in_dir.string() << endl;
+		return false;
+	}
+	if (!create_directories(music_out_dir, error) && !is_directory(music_out_dir))
+	{
+		cout << "Could not create output directory: " << music_out_dir.string() << endl;
+		return false;
+	}
+
+	std::vector<path> data_files = regular_files(data_dir);
+	std::vector<path> music_files = regular_files(music_in_dir);
+	size_t pairs = min(data_files.size(), music_files.size());
+
+	if (data_files.size() != music_files.size())
+		cout << "Pairing the first " << pairs << " of " << data_files.size() << " data and " << music_files.size() << " media files" << endl;
+
+	for (size_t index = 0; index < pairs; index++)
+		jobs.push_back({ ENCODE, data_files[index], music_files[index], music_out_dir / music_files[index].filename() });
+	return true;
+}
+
+bool whisper::list_batch_decode_jobs(const path& music_in_dir, const path& data_out_dir, std::vector<batch_job>& jobs)
+{
+	std::error_code error;
+
+	if (!is_directory(music_in_dir))
+	{
+		cout << "Batch input directory not found: " << music_in_dir.string() << endl;
+		return false;
+	}
+	if (!create_directories(data_out_dir, error) && !is_directory(data_out_dir))
+	{
+		cout << "Could not create output directory: " << data_out_dir.string() << endl;
+		return false;
+	}
+
+	for (const auto& music_file : regular_files(music_in_dir))
+		jobs.push_back({ DECODE, data_out_dir / music_file.stem(), music_file, path() });
+	return true;
+}
+
+// Output paths the jobs of a batch have taken, as the file system resolves them.
+class output_claims
+{
+private:
+	std::mutex lock;
+	std::set<path> claimed;
+public:
+	bool claim(const path& file_path)
+	{
+		std::error_code error;
+		path resolved = weakly_canonical(file_path, error);
+
+		if (error)
+			resolved = absolute(file_path, error).lexically_normal();
+		std::lock_guard<std::mutex> guard(lock);
+		return claimed.insert(resolved).second;
+	}
+};
+
+static batch_result run_batch_job(const batch_job& job, const whisper_engine& settings, output_claims& claims)
+{
+	engine_lease lease(shared_engine_pool());
+	whisper_engine& engine = *lease;
+	std::ostringstream messages;
+	batch_result result = { 0 };
+	auto start = std::chrono::steady_clock::now();
+
+	engine.apply_settings(settings);
+	engine.set_thread_count(1);
+	engine.set_message_stream(messages);
+	engine.set_output_claim([&claims](const path& file_path) { return claims.claim(file_path); });
+
+	try
+	{
+		engine.set_in_musicpath(job.music_in_path);
+		result.media_bytes = file_size(job.music_in_path);
+
+		if (job.encode)
+		{
+			engine.set_in_datafile_name(job.data_path);
+			engine.set_out_musicpath(job.music_out_path);
+			result.status = engine.open_files_for_encoding();
+			if (!result.status)
+				result.status = engine.encode_data();
+		}
+		else
+		{
+			engine.set_out_datadir(job.data_path);
+			result.status = engine.open_files_for_decoding();
+			if (!result.status)
+				result.status = engine.decode_data();
+		}
+		result.data_bytes = engine.data_byte_count();
+	}
+	catch (const whisper_error&)
+	{
+		result.status = -1;
+	}
+	catch (const filesystem_error& error)
+	{
+		messages << error.what() << endl;
+		result.status = -1;
+	}
+	catch (const std::exception& error)
+	{
+		messages << error.what() << endl;
+		result.status = -1;
+	}
+	engine.close_files();
+
+	result.stats = engine.stats();
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.messages = messages.str();
+	return result;
+}
+
+size_t whisper::run_batch(const std::vector<batch_job>& jobs, const whisper_engine& settings, std::ostream* stats)
+{
+	work_stealing_pool pool;
+	std::mutex report_lock;
+	std::vector<batch_result> results(stats ? jobs.size() : 0);
+	output_claims claims;
+	size_t failed = 0;
+	uint64_t media_bytes = 0;
+	uint64_t data_bytes = 0;
+	auto start = std::chrono::steady_clock::now();
+
+	pool.run(settings.get_thread_count(), jobs.size(), [&](size_t index, size_t)
+	{
+		const batch_job& job = jobs[index];
+		batch_result result = { 0 };
+
+		try
+		{
+			result = run_batch_job(job, settings, claims);
+		}
+		catch (const std::exception& error)		// such as no memory for an engine
+		{
+			result.status = -1;
+			result.messages = std::string(error.what()) + "\n";
+		}
+
+		std::lock_guard<std::mutex> guard(report_lock);
+		if (stats)
+			results[index] = result;
+		cout << "[" << setw(5) << index + 1 << "] " << (result.status ? "FAILED " : "ok     ")
+			<< (job.encode ? "encode " : "decode ") << job.music_in_path.string()
+			<< " (" << fixed << setprecision(3) << result.seconds << " s)" << endl;
+		if (result.status)
+		{
+			std::istringstream lines(result.messages);
+			std::string line;
+			while (getline(lines, line))
+				cout << "        " << line << endl;
+			failed++;
+		}
+		else
+		{
+			media_bytes += result.media_bytes;
+			data_bytes += result.data_bytes;
+		}
+	});
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	double megabytes = media_bytes / 1048576.0;
+
+	cout << "Batch: " << jobs.size() << " jobs, " << jobs.size() - failed << " succeeded, " << failed << " failed" << endl;
+	cout << "       " << fixed << setprecision(1) << megabytes << " MB of media and " << data_bytes / 1048576.0
+		<< " MB of data in " << setprecision(3) << seconds << " s";
+	if (seconds > 0)
+		cout << " (" << setprecision(1) << megabytes / seconds << " MB/s, " << jobs.size() / seconds << " jobs/s)";
+	cout << endl;
+
+	pool_stats blocks = shared_buffer_pool().stats();
+	engine_pool_stats engines = shared_engine_pool().stats();
+	cout << "       Engines: " << engines.misses << " made, " << engines.hits << " reused; I/O blocks: "
+		<< blocks.misses << " allocated (" << blocks.huge_blocks << " on huge pages), " << blocks.hits << " reused, "
+		<< setprecision(1) << blocks.peak_bytes / 1048576.0 << " MB at most" << endl;
+
+	if (stats)
+	{
+		*stats << "{" << endl << "  \"jobs\": [";
+		for (size_t index = 0; index < results.size(); index++)
+		{
+			*stats << (index ? "," : "") << endl << "    { \"job\": " << index + 1
+				<< ", \"media\": " << json_string(jobs[index].music_in_path.string())
+				<< ", \"status\": \"" << (results[index].status ? "failed" : "ok") << "\", \"stats\": ";
+			write_stats_json(*stats, results[index].stats, "    ");
+			*stats << " }";
+		}
+		*stats << endl << "  ]" << endl << "}" << endl;
+	}
+	return failed;
+}
@@ -0,0 +1,57 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include "whisper.h"
+
+namespace whisper
+{
+	typedef struct batch_job
+	{
+		bool encode;
+		filesystem::path data_path;			// payload to embed, or directory to decode into
+		filesystem::path music_in_path;
+		filesystem::path music_out_path;	// encode only
+	} batch_job;
+
+	typedef struct batch_result
+	{
+		int status;
+		uint64_t media_bytes;
+		uint64_t data_bytes;
+		double seconds;
+		std::string messages;
+		engine_stats stats;
+	} batch_result;
+
+	// Manifest lines are tab-separated, blank lines and lines starting with # are skipped:
+	//   encode <data_file_path> <sound_file_in_path> <sound_file_out_path>
+	//   decode <sound_file_in_path> <data_out_path>
+	bool read_batch_manifest(const filesystem::path& manifest_path, std::vector<batch_job>& jobs);
+
+	// Pairs the files of data_dir with those of music_in_dir in name order; each encoded file
+	// takes its carrier's name in music_out_dir.
+	bool list_batch_encode_jobs(const filesystem::path& data_dir, const filesystem::path& music_in_dir,
+		const filesystem::path& music_out_dir, std::vector<batch_job>& jobs);
+
+	// Each carrier decodes into a directory of its own in data_out_dir, named after its stem, so
+	// that carriers hiding files of the same name do not overwrite each other.
+	bool list_batch_decode_jobs(const filesystem::path& music_in_dir, const filesystem::path& data_out_dir,
+		std::vector<batch_job>& jobs);
+
+	// Runs the jobs on a work-stealing pool of settings.get_thread_count() threads, each job on a
+	// single-threaded engine from shared_engine_pool() with the kernel and I/O settings of settings.
+	// Prints a line per job as it finishes and a summary of throughput and of how much the engines
+	// and I/O blocks were reused; returns the number of failed jobs. A job that would write a file
+	// another job of the batch has written or is writing fails instead. Given stats, writes the stage
+	// counters of every job to it as JSON, in job order, once all have run.
+	size_t run_batch(const std::vector<batch_job>& jobs, const whisper_engine& settings, std::ostream* stats = nullptr);
+}
@@ -0,0 +1,580 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+// Times the engine on synthetic carriers, generated into a scratch directory, for every
+// combination of the carriers, kernels and I/O modes asked for. Each carrier goes through four
+// stages: a capacity scan, an encode of half the data the carrier holds at the default
+// threshold, a decode of the result, and an encode of a single byte, of which only the tail
+// copy, as the engine times it, is reported. Files are read back warm from the page cache, as
+// they were just written.
+
+#include "whisper.h"
+
+#include <cmath>
+
+using namespace whisper;
+
+enum signal_kind
+{
+	signal_sine,		// a 440 Hz tone at half of full scale
+	signal_noise,		// white noise over most of full scale
+	signal_silence,		// nine tenths digital silence, with bursts of noise
+	signal_music		// Laplacian samples under a slowly wandering envelope, as in recordings
+};
+
+const char* signal_names[] = { "sine", "noise", "silence", "music" };
+const uint32_t bench_sample_rate = 44100;
+
+typedef struct carrier_spec
+{
+	signal_kind signal;
+	uint32_t bits;
+	uint32_t channels;
+	uint64_t bytes;		// of samples
+} carrier_spec;
+
+typedef struct bench_config
+{
+	std::vector<signal_kind> signals;
+	std::vector<uint32_t> bits;
+	std::vector<uint32_t> channels;
+	std::vector<uint64_t> sizes;
+	std::vector<simd_level> kernels;
+	std::vector<io_mode> io_modes;
+	size_t threads;
+	size_t repeats;			// the best time of these is reported
+	path dir;
+	bool csv;
+} bench_config;
+
+typedef struct bench_result
+{
+	bool ran;
+	double seconds;
+} bench_result;
+
+// xorshift64*, so that carriers come out the same everywhere
+class bench_random
+{
+private:
+	uint64_t state;
+public:
+	bench_random(uint64_t seed) : state(seed ? seed : 1) {}
+
+	uint64_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545f4914f6cdd1dull;
+	}
+
+	double uniform() { return (next() >> 11) * (1.0 / 9007199254740992.0); }	// [0, 1)
+};
+
+class signal_generator
+{
+private:
+	signal_kind kind;
+	bench_random random;
+	uint64_t frame;
+	double envelope;
+	double envelope_step;
+	bool burst;
+public:
+	signal_generator(signal_kind kind, uint64_t seed) : kind(kind), random(seed), frame(0), envelope(0.3), envelope_step(0), burst(false) {}
+
+	// One sample in [-1, 1] for channel of the current frame; the channels of a frame go in turn.
+	double next(uint32_t channel, uint32_t channels)
+	{
+		double value = 0;
+
+		switch (kind)
+		{
+		case signal_sine:
+			value = 0.5 * std::sin(2 * 3.14159265358979 * 440 * frame / bench_sample_rate + channel);
+			break;
+		case signal_noise:
+			value = 1.6 * (random.uniform() - 0.5);
+			break;
+		case signal_silence:
+			if (frame % (bench_sample_rate / 10) == 0 && channel == 0)
+				burst = random.uniform() < 0.1;
+			value = burst ? 0.6 * (random.uniform() - 0.5) : 0;
+			break;
+		case signal_music:
+			if (channel == 0)
+			{
+				if (frame % (bench_sample_rate / 100) == 0)
+					envelope_step = (random.uniform() - 0.5) * 0.05;
+				envelope = std::clamp(envelope + envelope_step / (bench_sample_rate / 100), 0.02, 1.0);
+			}
+			value = -std::log(1 - random.uniform()) * 0.12 * envelope;
+			if (random.next() & 1)
+				value = -value;
+			break;
+		}
+		if (channel + 1 == channels)
+			frame++;
+		return std::clamp(value, -1.0, 1.0);
+	}
+};
+
+static std::string size_text(uint64_t bytes)
+{
+	std::ostringstream text;
+
+	if (bytes >= (1ull << 30) && bytes % (1ull << 30) == 0)
+		text << (bytes >> 30) << "G";
+	else if (bytes >= (1 << 20) && bytes % (1 << 20) == 0)
+		text << (bytes >> 20) << "M";
+	else if (bytes >= (1 << 10) && bytes % (1 << 10) == 0)
+		text << (bytes >> 10) << "K";
+	else
+		text << bytes;
+	return text.str();
+}
+
+static std::string carrier_text(const carrier_spec& spec)
+{
+	std::ostringstream text;
+
+	text << signal_names[spec.signal] << " " << spec.bits << "-bit " << (spec.channels == 1 ? "mono" : "stereo")
+		<< " " << size_text(spec.bytes);
+	return text.str();
+}
+
+static const char* io_mode_name(io_mode mode)
+{
+	static const char* names[] = { "buffered", "mmap", "patch", "async" };
+	return names[mode];
+}
+
+template<typename T>
+static void put(std::ostream& out, T value)
+{
+	out.write((const char*)&value, sizeof(value));
+}
+
+// A PCM WAV, or RF64 once the sizes pass 32 bits.
+static bool write_carrier(const path& file_path, const carrier_spec& spec)
+{
+	std::ofstream out(file_path, std::ios::binary | std::ios::trunc);
+	uint32_t sample_bytes = spec.bits / 8;
+	uint32_t frame_bytes = sample_bytes * spec.channels;
+	uint64_t data_bytes = spec.bytes / frame_bytes * frame_bytes;
+	bool rf64 = data_bytes + 36 > UINT32_MAX;
+	signal_generator generator(spec.signal, 0x5eed0000ull + spec.signal * 131 + spec.bits * 7 + spec.channels);
+	std::vector<char> block(1 << 20);
+	double full_scale = (double)((1u << (spec.bits - 1)) - 1);
+
+	out.write(rf64 ? "RF64" : "RIFF", 4);
+	put<uint32_t>(out, rf64 ? UINT32_MAX : (uint32_t)(data_bytes + 36));
+	out.write("WAVE", 4);
+	if (rf64)
+	{
+		out.write("ds64", 4);
+		put<uint32_t>(out, 28);
+		put<uint64_t>(out, data_bytes + 36 + 36);
+		put<uint64_t>(out, data_bytes);
+		put<uint64_t>(out, data_bytes / frame_bytes);
+		put<uint32_t>(out, 0);		// no table of other chunks
+	}
+	out.write("fmt ", 4);
+	put<uint32_t>(out, 16);
+	put<uint16_t>(out, (uint16_t)wave_format_pcm);
+	put<uint16_t>(out, (uint16_t)spec.channels);
+	put<uint32_t>(out, bench_sample_rate);
+	put<uint32_t>(out, bench_sample_rate * frame_bytes);
+	put<uint16_t>(out, (uint16_t)frame_bytes);
+	put<uint16_t>(out, (uint16_t)spec.bits);
+	out.write("data", 4);
+	put<uint32_t>(out, rf64 ? UINT32_MAX : (uint32_t)data_bytes);
+
+	size_t block_frames = block.size() / frame_bytes;
+	for (uint64_t written = 0; written < data_bytes && out;)
+	{
+		size_t frames = (size_t)min<uint64_t>(block_frames, (data_bytes - written) / frame_bytes);
+		char* next = block.data();
+
+		for (size_t index = 0; index < frames * spec.channels; index++)
+		{
+			int32_t sample = (int32_t)std::lround(generator.next((uint32_t)(index % spec.channels), spec.channels) * full_scale);
+			for (uint32_t byte = 0; byte < sample_bytes; byte++)
+				*next++ = (char)(sample >> (8 * byte));
+		}
+		out.write(block.data(), next - block.data());
+		written += next - block.data();
+	}
+	return (bool)out;
+}
+
+static bool write_payload(const path& file_path, uint64_t bytes)
+{
+	std::ofstream out(file_path, std::ios::binary | std::ios::trunc);
+	bench_random random(0xda7a);
+	std::vector<uint64_t> block(1 << 17);
+
+	for (uint64_t written = 0; written < bytes && out;)
+	{
+		size_t count = (size_t)min<uint64_t>(block.size() * sizeof(uint64_t), bytes - written);
+		for (auto& word : block)
+			word = random.next();
+		out.write((const char*)block.data(), count);
+		written += count;
+	}
+	return (bool)out;
+}
+
+static void configure(whisper_engine& engine, const bench_config& config, simd_level kernel, io_mode mode, std::ostream& messages)
+{
+	engine.reset();
+	engine.set_message_stream(messages);
+	engine.set_kernel_level(kernel);
+	engine.set_io_mode(mode);
+	engine.set_thread_count(config.threads);
+}
+
+// Runs stage on engine repeats times and keeps the best time, of the whole run or, short of
+// stage_count, of that one stage as the engine timed it; a stage returning nonzero or throwing
+// fails the measurement, and its messages are shown.
+template<typename STAGE_T>
+static bench_result measure(whisper_engine& engine, const bench_config& config, simd_level kernel, io_mode mode, STAGE_T stage,
+	stats_stage timed_stage = stage_count)
+{
+	bench_result result = { false, 0 };
+
+	for (size_t repeat = 0; repeat < config.repeats; repeat++)
+	{
+		std::ostringstream messages;
+		int status;
+
+		configure(engine, config, kernel, mode, messages);
+		auto start = std::chrono::steady_clock::now();
+		try
+		{
+			status = stage();
+		}
+		catch (const std::exception& failure)
+		{
+			messages << failure.what() << endl;
+			status = -1;
+		}
+		engine.close_files();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (timed_stage != stage_count)
+			seconds = engine.stats().stages[timed_stage].seconds;
+
+		if (status)
+		{
+			cerr << messages.str();
+			return { false, 0 };
+		}
+		result.seconds = result.ran ? min(result.seconds, seconds) : seconds;
+		result.ran = true;
+	}
+	return result;
+}
+
+static void report(const bench_config& config, const carrier_spec& spec, const char* stage, simd_level kernel, io_mode mode, const bench_result& result)
+{
+	uint64_t samples = spec.bytes / (spec.bits / 8);
+	double megabytes_per_second = result.seconds > 0 ? spec.bytes / 1048576.0 / result.seconds : 0;
+	double ns_per_sample = samples ? result.seconds * 1e9 / samples : 0;
+
+	if (config.csv)
+	{
+		cout << signal_names[spec.signal] << "," << spec.bits << "," << spec.channels << "," << spec.bytes << "," << stage << ","
+			<< simd_level_name(kernel) << "," << io_mode_name(mode) << "," << config.threads << ",";
+		if (result.ran)
+			cout << std::setprecision(6) << result.seconds << "," << megabytes_per_second << "," << ns_per_sample;
+		else
+			cout << ",,";
+		cout << endl;
+		return;
+	}
+
+	cout << std::left << setw(28) << carrier_text(spec) << setw(11) << stage << setw(8) << simd_level_name(kernel)
+		<< setw(10) << io_mode_name(mode) << std::right;
+	if (result.ran)
+		cout << fixed << setprecision(1) << setw(11) << megabytes_per_second << setprecision(3) << setw(12) << ns_per_sample;
+	else
+		cout << setw(11) << "-" << setw(12) << "-";
+	cout << endl;
+}
+
+static void run_carrier(const bench_config& config, const carrier_spec& spec)
+{
+	path carrier_path = config.dir / "carrier.wav";
+	path payload_path = config.dir / "payload.bin";
+	path tiny_path = config.dir / "tiny.bin";
+	path encoded_path = config.dir / "encoded.wav";
+	path decoded_dir = config.dir / "decoded";
+	whisper_engine engine;
+	capacity_report capacity = { 0 };
+	uint64_t payload_bytes = 0;
+	std::error_code error;
+
+	if (!write_carrier(carrier_path, spec) || !write_payload(tiny_path, 1))
+	{
+		cerr << "Could not write the carrier for " << carrier_text(spec) << " to " << config.dir.string() << endl;
+		return;
+	}
+
+	for (simd_level kernel : config.kernels)
+	{
+		for (io_mode mode : config.io_modes)
+		{
+			bench_result result = measure(engine, config, kernel, mode, [&]
+			{
+				engine.set_in_musicpath(carrier_path);
+				return engine.open_files_for_analysis() || engine.analyze_capacity(capacity);
+			});
+			report(config, spec, "capacity", kernel, mode, result);
+
+			// half of what fits at the default threshold, one bit per sample
+			if (!payload_bytes && result.ran)
+			{
+				uint32_t threshold_factor = threshold_factor_for(capacity.format, default_threshold_factor);
+				payload_bytes = engine.capacity_bytes(capacity, threshold_factor, 1) / 2;
+				if (payload_bytes && !write_payload(payload_path, payload_bytes))
+					payload_bytes = 0;
+			}
+
+			result = { false, 0 };
+			if (payload_bytes)
+			{
+				result = measure(engine, config, kernel, mode, [&]
+				{
+					filesystem::remove(encoded_path, error);
+					engine.set_in_musicpath(carrier_path);
+					engine.set_in_datafile_name(payload_path);
+					engine.set_out_musicpath(encoded_path);
+					return engine.open_files_for_encoding() || engine.encode_data();
+				});
+			}
+			report(config, spec, "encode", kernel, mode, result);
+
+			if (result.ran)
+			{
+				result = measure(engine, config, kernel, mode, [&]
+				{
+					filesystem::remove_all(decoded_dir, error);
+					engine.set_in_musicpath(encoded_path);
+					engine.set_out_datadir(decoded_dir);
+					return engine.open_files_for_decoding() || engine.decode_data();
+				});
+			}
+			report(config, spec, "decode", kernel, mode, result);
+
+			result = measure(engine, config, kernel, mode, [&]
+			{
+				filesystem::remove(encoded_path, error);
+				engine.set_in_musicpath(carrier_path);
+				engine.set_in_datafile_name(tiny_path);
+				engine.set_out_musicpath(encoded_path);
+				return engine.open_files_for_encoding() || engine.encode_data();
+			}, stage_tail);
+			report(config, spec, "tail copy", kernel, mode, result);
+		}
+	}
+
+	filesystem::remove(carrier_path, error);
+	filesystem::remove(payload_path, error);
+	filesystem::remove(tiny_path, error);
+	filesystem::remove(encoded_path, error);
+	filesystem::remove_all(decoded_dir, error);
+}
+
+static std::vector<std::string> split_list(const std::string& list)
+{
+	std::vector<std::string> items;
+	std::istringstream text(list);
+	std::string item;
+
+	while (getline(text, item, ','))
+	{
+		if (!item.empty())
+			items.push_back(item);
+	}
+	return items;
+}
+
+static bool parse_size(const std::string& text, uint64_t& size)
+{
+	char* end = nullptr;
+	unsigned long long value = strtoull(text.c_str(), &end, 10);
+
+	if (end == text.c_str())
+		return false;
+	if (*end == 'K' || *end == 'k')
+		value <<= 10, end++;
+	else if (*end == 'M' || *end == 'm')
+		value <<= 20, end++;
+	else if (*end == 'G' || *end == 'g')
+		value <<= 30, end++;
+	size = value;
+	return *end == '\0' && value > 0;
+}
+
+static void show_usage()
+{
+	cout << "whisper_bench [options]" << endl;
+	cout << "Options, lists separated by commas:" << endl;
+	cout << "  --signals=sine,noise,silence,music   carriers to generate (default: all)" << endl;
+	cout << "  --bits=16,24                         sample sizes (default: both)" << endl;
+	cout << "  --channels=1,2                       mono, stereo or both (default: stereo)" << endl;
+	cout << "  --sizes=<bytes>[K|M|G],...           carrier sizes (default 64M)" << endl;
+	cout << "  --kernels=scalar,avx2,avx512         sample kernels (default: all this processor supports)" << endl;
+	cout << "  --io=buffered,mmap,async,patch       I/O modes (default: all)" << endl;
+	cout << "  --threads=<count>                    engine threads (default 1)" << endl;
+	cout << "  --repeat=<count>                     runs of each stage, the best of which is reported (default 3)" << endl;
+	cout << "  --dir=<path>                         scratch directory for the carriers (default: the system's temporary one)" << endl;
+	cout << "  --csv                                comma-separated output, for comparing releases" << endl;
+}
+
+static bool parse_options(int argc, char** argv, bench_config& config)
+{
+	for (int index = 1; index < argc; index++)
+	{
+		std::string arg = argv[index];
+		size_t equals = arg.find('=');
+		std::string name = arg.substr(0, equals);
+		std::vector<std::string> values = equals == std::string::npos ? std::vector<std::string>() : split_list(arg.substr(equals + 1));
+
+		if (name == "--csv" && equals == std::string::npos)
+		{
+			config.csv = true;
+			continue;
+		}
+		if (values.empty())
+			return false;
+
+		if (name == "--signals")
+		{
+			config.signals.clear();
+			for (const auto& value : values)
+			{
+				auto found = std::find_if(std::begin(signal_names), std::end(signal_names), [&](const char* known) { return value == known; });
+				if (found == std::end(signal_names))
+					return false;
+				config.signals.push_back((signal_kind)(found - std::begin(signal_names)));
+			}
+		}
+		else if (name == "--bits" || name == "--channels")
+		{
+			std::vector<uint32_t>& list = name == "--bits" ? config.bits : config.channels;
+			list.clear();
+			for (const auto& value : values)
+			{
+				uint32_t number = (uint32_t)strtoul(value.c_str(), nullptr, 10);
+				if (name == "--bits" ? number != 16 && number != 24 : number != 1 && number != 2)
+					return false;
+				list.push_back(number);
+			}
+		}
+		else if (name == "--sizes")
+		{
+			config.sizes.clear();
+			for (const auto& value : values)
+			{
+				uint64_t size = 0;
+				if (!parse_size(value, size))
+					return false;
+				config.sizes.push_back(size);
+			}
+		}
+		else if (name == "--kernels")
+		{
+			config.kernels.clear();
+			for (const auto& value : values)
+			{
+				simd_level level = value == "scalar" ? simd_scalar : value == "avx2" ? simd_avx2 : value == "avx512" ? simd_avx512 : (simd_level)-1;
+				if (level == (simd_level)-1)
+					return false;
+				if (level > detect_simd_level())
+				{
+					cerr << "This processor does not support " << value << " kernels" << endl;
+					return false;
+				}
+				config.kernels.push_back(level);
+			}
+		}
+		else if (name == "--io")
+		{
+			config.io_modes.clear();
+			for (const auto& value : values)
+			{
+				if (value == "buffered")
+					config.io_modes.push_back(io_buffered);
+				else if (value == "mmap")
+					config.io_modes.push_back(io_mapped);
+				else if (value == "async")
+					config.io_modes.push_back(io_async);
+				else if (value == "patch")
+					config.io_modes.push_back(io_patched);
+				else
+					return false;
+			}
+		}
+		else if (name == "--threads" || name == "--repeat")
+		{
+			size_t count = (size_t)strtoul(values[0].c_str(), nullptr, 10);
+			if (!count)
+				return false;
+			(name == "--threads" ? config.threads : config.repeats) = count;
+		}
+		else if (name == "--dir")
+		{
+			config.dir = values[0];
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	bench_config config = { { signal_sine, signal_noise, signal_silence, signal_music }, { 16, 24 }, { 2 }, { 64 << 20 },
+		{}, { io_buffered, io_mapped, io_async, io_patched }, 1, 3, path(), false };
+	std::error_code error;
+
+	for (int level = simd_scalar; level <= detect_simd_level(); level++)
+		config.kernels.push_back((simd_level)level);
+
+	if (!parse_options(argc, argv, config))
+	{
+		show_usage();
+		return 1;
+	}
+	if (config.dir.empty())
+		config.dir = filesystem::temp_directory_path(error) / "whisper_bench";
+	if (!filesystem::is_directory(config.dir) && !filesystem::create_directories(config.dir, error))
+	{
+		cerr << "Could not create " << config.dir.string() << endl;
+		return 1;
+	}
+
+	if (config.csv)
+		cout << "signal,bits,channels,bytes,stage,kernel,io,threads,seconds,mb_per_s,ns_per_sample" << endl;
+	else
+		cout << std::left << setw(28) << "carrier" << setw(11) << "stage" << setw(8) << "kernel" << setw(10) << "io"
+			<< std::right << setw(11) << "MB/s" << setw(12) << "ns/sample" << endl;
+
+	for (uint64_t size : config.sizes)
+		for (signal_kind signal : config.signals)
+			for (uint32_t bits : config.bits)
+				for (uint32_t channels : config.channels)
+					run_carrier(config, { signal, bits, channels, size });
+	return 0;
+}
@@ -0,0 +1,104 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_delta.h"
+
+#include <cstring>
+
+using namespace whisper;
+
+uint64_t whisper::fingerprint_bytes(uint64_t fingerprint, const void* data, size_t count)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+
+	for (size_t index = 0; index < count; index++)
+	{
+		fingerprint ^= bytes[index];
+		fingerprint *= 0x100000001b3ull;
+	}
+	return fingerprint;
+}
+
+void delta_writer::begin(const void* wav_header, uint32_t header_bytes, uint32_t mask_factor)
+{
+	header = delta_header();
+	memcpy(header.magic, delta_magic, sizeof(header.magic));
+	header.mask_factor = mask_factor;
+	header.sample_offset = header_bytes;
+	header.fingerprint = fingerprint_bytes(fingerprint_basis, wav_header, header_bytes);
+	entries.clear();
+	next_sample = 0;
+	last_change = 0;
+}
+
+void delta_writer::add(const int16_t* before, const int16_t* after, size_t count)
+{
+	header.fingerprint = fingerprint_bytes(header.fingerprint, before, count * sizeof(int16_t));
+
+	for (size_t index = 0; index < count; index++)
+	{
+		if (before[index] == after[index])
+			continue;
+
+		uint64_t sample = next_sample + index;
+		uint64_t gap = sample - last_change;
+
+		do
+		{
+			entries.push_back((uint8_t)((gap & 0x7f) | (gap > 0x7f ? 0x80 : 0)));
+			gap >>= 7;
+		} while (gap);
+
+		if (header.mask_factor > 1)
+			entries.push_back((uint8_t)((before[index] < 0 ? -before[index] : before[index]) ^ (after[index] < 0 ? -after[index] : after[index])));
+
+		last_change = sample + 1;
+		header.change_count++;
+	}
+	next_sample += count;
+}
+
+bool delta_writer::finish(std::ostream& out, uint64_t carrier_bytes)
+{
+	header.carrier_bytes = carrier_bytes;
+	header.prefix_bytes = header.sample_offset + next_sample * sizeof(int16_t);
+
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)entries.data(), entries.size());
+	header.mask_factor = 0;		// inactive until the next begin
+	return out.good();
+}
+
+bool delta_reader::read(uint64_t& sample_index, uint8_t& change)
+{
+	uint64_t gap = 0;
+	int shift = 0;
+
+	do
+	{
+		if (next == end || shift > 63)
+			return false;
+		gap |= (uint64_t)(*next & 0x7f) << shift;
+		shift += 7;
+	} while (*next++ & 0x80);
+
+	change = 1;
+	if (mask_factor > 1)
+	{
+		if (next == end)
+			return false;
+		change = *next++;
+	}
+
+	sample += gap + (started ? 1 : 0);
+	started = true;
+	sample_index = sample;
+	return true;
+}
@@ -0,0 +1,84 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+namespace whisper
+{
+	// A delta records how encoding changes a carrier, so that the encoded WAV can be rebuilt from a
+	// copy of the carrier elsewhere. The header is followed by change_count entries, one per changed
+	// sample: the number of unchanged samples since the previous change as a LEB128 varint, then,
+	// unless mask_factor is 1, a byte to XOR into the sample's magnitude (with one bit per sample
+	// that is always 1). The fingerprint covers the carrier up to the last sample the encoder read
+	// while embedding, which takes in every sample a delta can change.
+#pragma pack(push, 1)
+	typedef struct delta_header
+	{
+		uint8_t  magic[8];					// { 'W','H','S','P','D','L','T','1' }
+		uint32_t mask_factor;				// most payload bits of any changed sample
+		uint32_t sample_offset;				// byte offset of sample 0, the end of the WAV header
+		uint64_t carrier_bytes;				// size of the carrier
+		uint64_t prefix_bytes;				// carrier bytes covered by the fingerprint
+		uint64_t fingerprint;				// FNV-1a of the carrier's first prefix_bytes
+		uint64_t change_count;
+	} delta_header;
+#pragma pack(pop)
+
+	const uint8_t delta_magic[8] = { 'W','H','S','P','D','L','T','1' };
+	const uint64_t fingerprint_basis = 0xcbf29ce484222325ull;
+
+	uint64_t fingerprint_bytes(uint64_t fingerprint, const void* data, size_t count);
+
+	// Sign-preserving magnitude change, as the embed kernels make it.
+	inline int16_t apply_magnitude_xor(int16_t sample, uint8_t change)
+	{
+		int16_t magnitude = (int16_t)((sample < 0 ? -sample : sample) ^ change);
+		return sample < 0 ? -magnitude : magnitude;
+	}
+
+	// Collects the changes of an encode as its samples go by, in order.
+	class delta_writer
+	{
+	private:
+		delta_header header;
+		std::vector<uint8_t> entries;
+		uint64_t next_sample;		// index of the next sample to be compared
+		uint64_t last_change;		// one past the index of the last changed sample
+	public:
+		delta_writer() : header(), next_sample(0), last_change(0) {}
+
+		bool active() const { return header.mask_factor != 0; }
+
+		void begin(const void* wav_header, uint32_t header_bytes, uint32_t mask_factor);
+		void add(const int16_t* before, const int16_t* after, size_t count);
+		bool finish(std::ostream& out, uint64_t carrier_bytes);
+	};
+
+	// Walks the entries of a delta; false once they run out or are malformed.
+	class delta_reader
+	{
+	private:
+		const uint8_t* next;
+		const uint8_t* end;
+		uint32_t mask_factor;
+		uint64_t sample;
+		bool started;
+	public:
+		delta_reader(const std::vector<uint8_t>& entries, uint32_t mask_factor)
+			: next(entries.data()), end(entries.data() + entries.size()), mask_factor(mask_factor), sample(0), started(false) {}
+
+		bool read(uint64_t& sample_index, uint8_t& change);
+	};
+}
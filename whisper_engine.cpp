@@ -12,7 +12,36 @@
 
 using namespace whisper;
 
+// one bit per eligible sample, for the whisper metadata and by default for the payload
+static const uint32_t default_mask_factor = 1;
 
+// Spans are split across threads only when every thread gets at least min_parallel_slice
+// samples and at least that many payload bits remain; max_parallel_slice bounds how far
+// the eligible-sample count pass runs ahead of the payload.
+static const size_t min_parallel_slice = 64 << 10;
+static const size_t max_parallel_slice = 1 << 20;
+
+// 24- and 32-bit samples are unpacked into 32-bit ones this many at a time.
+static const size_t wide_block_samples = 64 << 10;
+
+const char* whisper::whisper_status_text(whisper_status status)
+{
+	switch (status)
+	{
+	case whisper_ok:				return "success";
+	case whisper_invalid_argument:	return "invalid argument";
+	case whisper_file_error:		return "file not found or not accessible";
+	case whisper_read_error:		return "read error or unexpected end of input";
+	case whisper_write_error:		return "write error";
+	case whisper_unsupported_media:	return "unsupported media format";
+	case whisper_not_enough_space:	return "not enough space in the media for the data";
+	case whisper_no_hidden_data:	return "no whisper data found";
+	case whisper_buffer_too_small:	return "output buffer too small";
+	case whisper_out_of_memory:		return "out of memory";
+	case whisper_carrier_mismatch:	return "the delta was made from another carrier";
+	}
+	return "unknown error";
+}
 
 fixed_metadata whisper_engine::get_whisper_metadata()
 {
@@ -24,124 +53,519 @@ void whisper_engine::set_whisper_metadata(fixed_metadata whisper_fields)
 	fixed_fields = whisper_fields;
 }
 
-ios_base::iostate whisper_engine::decode_whisper_metadata()
+uint64_t whisper_engine::data_byte_count() const
 {
-	uint8_t* md_ptr = (uint8_t *)&fixed_fields;
-	uint32_t index = 0;
-	ios_base::iostate status = 0;
+	uint64_t high = fixed_fields.attribits.metadata_version ? extended_fields.data_byte_count_high : 0;
+	return high << 32 | fixed_fields.data_byte_count;
+}
 
-	for(index = 0; !status && index < sizeof(fixed_fields); index++)
+// Sizes that fit in 32 bits keep the original metadata layout, so such encodes are unchanged.
+void whisper_engine::set_data_byte_count(uint64_t byte_count)
+{
+	fixed_fields.data_byte_count = (uint32_t)byte_count;
+	extended_fields.data_byte_count_high = (uint32_t)(byte_count >> 32);
+	fixed_fields.attribits.metadata_version = extended_fields.data_byte_count_high ? 1 : 0;
+}
+
+bool whisper_engine::set_kernel_level(simd_level level)
+{
+	bool supported = level <= detect_simd_level();
+
+	if (!supported)
 	{
-		status = decode_data_byte(md_ptr[index]);
+		*messages << "This processor does not support " << simd_level_name(level) << " kernels" << endl;
+		level = detect_simd_level();
 	}
+	kernel_level = level;
+	select_kernels(level, default_threshold_factor, default_mask_factor, metadata_kernels);
+	select_kernels(level, payload_threshold_factor(), selected_mask_factor, kernels);
+	histogram_span = select_histogram_kernel(level);
+	histogram_wide = select_wide_histogram_kernel(level);
+	return supported;
+}
 
-	if (status || index < sizeof(fixed_fields))
+bool whisper_engine::set_mask_factor(uint32_t mask_factor)
+{
+	if (mask_factor < 1 || mask_factor > max_mask_factor || !select_kernels(kernel_level, payload_threshold_factor(), mask_factor, kernels))
 	{
-		cout << "Unexpected EOF" << endl;
-		close_files();
-		exit(-1);
+		*messages << "Bits per sample must be between 1 and " << min(max_mask_factor, payload_threshold_factor()) << endl;
+		return false;
 	}
+	selected_mask_factor = mask_factor;
+	return true;
+}
 
-	if (fixed_fields.data_byte_count > 2340)
+bool whisper_engine::set_threshold_factor(uint32_t threshold_factor)
+{
+	if (threshold_factor && (threshold_factor < max(min_threshold_factor, selected_mask_factor) || threshold_factor > max_threshold_factor))
 	{
-		cout << "Possible misread of whisper metadata. Byte count: " << fixed_fields.data_byte_count << endl;
+		*messages << "Threshold factor must be between " << max(min_threshold_factor, selected_mask_factor) << " and " << max_threshold_factor << endl;
+		return false;
 	}
+	selected_threshold_factor = threshold_factor;
+	select_kernels(kernel_level, payload_threshold_factor(), selected_mask_factor, kernels);
+	return true;
+}
 
-	string m;
+uint32_t whisper_engine::payload_threshold_factor()
+{
+	return selected_threshold_factor ? selected_threshold_factor : default_threshold_factor;
+}
+
+void whisper_engine::apply_settings(const whisper_engine& settings)
+{
+	selected_mask_factor = settings.selected_mask_factor;
+	selected_threshold_factor = settings.selected_threshold_factor;
+	set_kernel_level(settings.kernel_level);
+	selected_io_mode = settings.selected_io_mode;
+	io_block_bytes = settings.io_block_bytes;
+}
+
+void whisper_engine::set_message_stream(std::ostream& stream)
+{
+	messages = &stream;
+}
 
-	for (index = 0; index < 7; index++)
+void whisper_engine::set_buffer_pool(buffer_pool* pool)
+{
+	if (pool == buffers)
+		return;
+	buffers = pool;
+	source.set_pool(pool);
+	sink.set_pool(pool);
+	payload.set_pool(pool);
+	media_reader.set_pool(pool);
+	media_writer.set_pool(pool);
+}
+
+void whisper_engine::set_io_mode(io_mode mode)
+{
+	selected_io_mode = mode;
+}
+
+void whisper_engine::set_thread_count(size_t threads)
+{
+	thread_count = threads ? threads : default_thread_count();
+}
+
+size_t whisper_engine::parallel_slices(size_t count, uint64_t bits)
+{
+	if (thread_count < 2 || count < 2 * min_parallel_slice || bits < min_parallel_slice)
+		return 1;
+	if (runner.size() != thread_count)
+		runner.resize(thread_count);
+	return min(thread_count, count / min_parallel_slice);
+}
+
+uint64_t whisper_engine::count_samples(const int16_t* in, size_t count)
+{
+	size_t slices = parallel_slices(count, count);
+
+	if (slices < 2)
+		return kernels.count(in, count);
+
+	size_t slice = (count + slices - 1) / slices;
+	std::vector<uint64_t> eligible(slices);
+
+	runner.run(slices, [&](size_t index)
 	{
-		m += (char) fixed_fields.magic[index];
+		size_t begin = min(count, index * slice);
+		eligible[index] = kernels.count(in + begin, min(slice, count - begin));
+	});
+	return std::accumulate(eligible.begin(), eligible.end(), (uint64_t)0);
+}
+
+// Counts the payload bits each slice of a round can hold in parallel and turns the counts into
+// each slice's first payload bit with an exclusive prefix sum. Returns the index of the slice
+// in which bit_count is reached, or slices if the payload continues past the round.
+size_t whisper_engine::plan_round(const kernel_set& set, const int16_t* in, size_t round, size_t slices,
+	uint64_t bit_index, uint64_t bit_count)
+{
+	size_t slice = (round + slices - 1) / slices;
+
+	slice_eligible.resize(slices);
+	slice_first_bit.resize(slices);
+
+	runner.run(slices, [&](size_t index)
+	{
+		size_t begin = min(round, index * slice);
+		slice_eligible[index] = set.count(in + begin, min(slice, round - begin)) * set.payload_bits;
+	});
+
+	for (size_t index = 0; index < slices; index++)
+	{
+		slice_first_bit[index] = bit_index;
+		bit_index += slice_eligible[index];
+		if (bit_index >= bit_count)
+			return index;
 	}
-	if (m != "WHISPER")
+	return slices;
+}
+
+// Same contract as the embed kernels. Each round is planned by plan_round, and the slices up to
+// the one in which the payload runs out are embedded concurrently. That last slice determines
+// where the span ends, so the result is identical to a single-threaded pass.
+size_t whisper_engine::embed_samples(const kernel_set& set, const int16_t* in, int16_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	size_t slices = parallel_slices(count, bit_count - bit_index);
+
+	if (slices < 2)
+		return set.embed(in, out, count, data, bit_index, bit_count);
+
+	size_t done = 0;
+
+	while (done < count && bit_index < bit_count)
 	{
-		cout << "No whisper data found" << endl;
-		close_files();
-		exit(-1);
+		size_t round = min(count - done, slices * max_parallel_slice);
+		size_t slice = (round + slices - 1) / slices;
+		size_t last = plan_round(set, in + done, round, slices, bit_index, bit_count);
+		size_t last_used = 0;
+
+		runner.run(last < slices ? last + 1 : slices, [&](size_t index)
+		{
+			size_t begin = min(round, index * slice);
+			size_t length = min(slice, round - begin);
+			uint64_t slice_bit = slice_first_bit[index];
+			uint64_t slice_end = min(slice_bit + slice_eligible[index], bit_count);
+			size_t used = set.embed(in + done + begin, out + done + begin, length, data, slice_bit, slice_end);
+
+			if (index == last)
+				last_used = used;
+			else if (used < length && in != out)
+				memcpy(out + done + begin + used, in + done + begin + used, (length - used) * sizeof(int16_t));
+		});
+
+		if (last < slices)
+		{
+			bit_index = bit_count;
+			return done + last * slice + last_used;
+		}
+		bit_index = slice_first_bit[slices - 1] + slice_eligible[slices - 1];
+		done += round;
 	}
-	else
+	return done;
+}
+
+// Same contract as the extract kernels, split across threads like embed_samples. Slices rarely
+// start on a byte boundary, and with several bits per sample a byte may take bits from samples
+// on both sides of one, so each slice extracts into its own bytes, aligned like data. The bytes
+// a slice fills alone are copied concurrently; the partial first and last ones are merged once
+// the round is done.
+size_t whisper_engine::extract_samples(const kernel_set& set, const int16_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	size_t slices = parallel_slices(count, bit_count - bit_index);
+
+	if (slices < 2)
+		return set.extract(in, count, data, bit_index, bit_count);
+
+	size_t done = 0;
+
+	slice_bytes.resize(slices);
+
+	while (done < count && bit_index < bit_count)
 	{
-		cout << "Identified whisper content" << endl;
+		size_t round = min(count - done, slices * max_parallel_slice);
+		size_t slice = (round + slices - 1) / slices;
+		size_t last = plan_round(set, in + done, round, slices, bit_index, bit_count);
+		size_t active = last < slices ? last + 1 : slices;
+		size_t last_used = 0;
+
+		runner.run(active, [&](size_t index)
+		{
+			size_t begin = min(round, index * slice);
+			size_t length = min(slice, round - begin);
+			uint64_t first = slice_first_bit[index];
+			uint64_t end = min(first + slice_eligible[index], bit_count);
+			size_t first_byte = (size_t)(first >> 3);
+			size_t end_byte = (size_t)((end + 7) >> 3);
+			std::vector<uint8_t>& bytes = slice_bytes[index];
+			uint64_t local_bit = first & 7;
+
+			bytes.assign(end_byte - first_byte, 0);
+			size_t used = set.extract(in + done + begin, length, bytes.data(), local_bit, local_bit + (end - first));
+
+			size_t own_first = first_byte + ((first & 7) ? 1 : 0);
+			size_t own_end = end_byte - ((end & 7) ? 1 : 0);
+			if (own_first < own_end)
+				memcpy(data + own_first, bytes.data() + (own_first - first_byte), own_end - own_first);
+
+			if (index == last)
+				last_used = used;
+		});
+
+		for (size_t index = 0; index < active; index++)
+		{
+			uint64_t first = slice_first_bit[index];
+			uint64_t end = min(first + slice_eligible[index], bit_count);
+			const std::vector<uint8_t>& bytes = slice_bytes[index];
+
+			if (end == first)
+				continue;
+			if (first & 7)
+				data[first >> 3] |= bytes.front();
+			if (end & 7)
+				data[(end - 1) >> 3] |= bytes.back();
+		}
+
+		if (last < slices)
+		{
+			bit_index = bit_count;
+			return done + last * slice + last_used;
+		}
+		bit_index = slice_first_bit[slices - 1] + slice_eligible[slices - 1];
+		done += round;
 	}
+	return done;
+}
 
-	return status;
+bool whisper_engine::set_io_block_size(size_t block_bytes)
+{
+	if (block_bytes < min_io_block_bytes || block_bytes > max_io_block_bytes)
+	{
+		*messages << "I/O block size must be between " << min_io_block_bytes << " and " << max_io_block_bytes << " bytes" << endl;
+		return false;
+	}
+	io_block_bytes = block_bytes;
+	return true;
 }
 
-ios_base::iostate whisper_engine::decode_whisper_embedded_filename()
+// Each call starts on a fresh sample, so with several bits per sample the last sample it uses may
+// carry fewer; the payload is embedded in blocks of payload_block_bytes to keep that independent
+// of the I/O block size.
+int whisper_engine::embed_bytes(const kernel_set& set, const uint8_t* data, size_t byte_count) // expects open files and does not close them
 {
-	uint32_t index = 0;
-	uint8_t data_byte = 0;
-	ios_base::iostate status = 0;
-	filename = "";
+	uint64_t bit_index = 0;
+	uint64_t bit_count = 8 * (uint64_t)byte_count;
+	uint64_t scanned = 0;
 
-	for (index = 0; !status && index < fixed_fields.attribits.filename_size; index++)
+	while (bit_index < bit_count)
 	{
-		status = decode_data_byte(data_byte);
-		char c = data_byte;
-		filename += c;
+		size_t available = source.fill();
+		if (!available)
+		{
+			return failed(whisper_not_enough_space);   // not enough sample space
+		}
+		size_t reserved = available * source.sample_size();
+		char* out = sink.reserve(reserved);
+		if (reserved < source.sample_size())
+		{
+			*messages << "File write error" << endl;
+			return failed(whisper_write_error);
+		}
+		size_t used = 0;
+		if (carrier_format == sample_int16)
+		{
+			used = embed_samples(set, source.samples(), (int16_t*)out, reserved / sizeof(int16_t), data, bit_index, bit_count);
+			if (delta_output)
+				delta.add(source.samples(), (int16_t*)out, used);
+		}
+		else
+		{
+			size_t count = min(unpack_available(source), reserved / source.sample_size());
+			if (carrier_format == sample_float64)
+				used = set.embed_wide64(wide_samples.data(), wide_samples.data(), count, data, bit_index, bit_count);
+			else
+				used = set.embed_wide((int32_t*)wide_samples.data(), (int32_t*)wide_samples.data(), count, data, bit_index, bit_count);
+			pack_samples(wide_samples.data(), (uint8_t*)out, used);
+		}
+		sink.commit(used * source.sample_size());
+		source.consume(used);
+		scanned += used;
 	}
+	count_field(set, byte_count, scanned);
+	return 0;
+}
+
+int whisper_engine::extract_bytes(const kernel_set& set, uint8_t* data, size_t byte_count) // expects open files and does not close them
+{
+	uint64_t bit_index = 0;
+	uint64_t bit_count = 8 * (uint64_t)byte_count;
+	uint64_t scanned = 0;
+
+	memset(data, 0, byte_count);
 
-	if (index < fixed_fields.attribits.filename_size)
+	while (bit_index < bit_count)
 	{
-		cout << "Unexpected EOF" << endl;
-		close_files();
-		exit(-1);
+		size_t available = source.fill();
+		if (!available)
+		{
+			*messages << "Unexpected EOF" << endl;
+			close_files();
+			throw whisper_error(whisper_read_error);
+		}
+		scanned += extract_available(set, source, data, bit_index, bit_count);
 	}
+	count_field(set, byte_count, scanned);
+	return 0;
+}
 
-	return status;
+// The carrier's sample format is known once its fmt chunk is: the metadata kernels and, unless they
+// already suit it, the payload kernels are chosen for it, with threshold factors moved to match.
+// Anything validate_wav_metadata would turn away is taken as 16-bit PCM until it does.
+void whisper_engine::set_carrier_format(const WavMetadata& metadata, sample_source& from)
+{
+	sample_format format = sample_int16;
+
+	if (metadata.format.format == wave_format_ieee_float)
+	{
+		if (metadata.format.numsamplebits == 32)
+			format = sample_float32;
+		else if (metadata.format.numsamplebits == 64)
+			format = sample_float64;
+	}
+	else if (metadata.format.numsamplebits == 24)
+		format = sample_int24;
+	else if (metadata.format.numsamplebits == 32)
+		format = sample_int32;
+
+	carrier_format = format;
+	from.set_sample_size(sample_format_bits(format) / 8);
+	if (format != sample_int16)
+	{
+		select_converters(kernel_level, format, unpack_samples, pack_samples);
+		wide_samples.resize(wide_block_samples);
+	}
+	select_kernels(kernel_level, threshold_factor_for(format, default_threshold_factor), default_mask_factor, metadata_kernels, format);
+	if (kernels.format != format)
+		select_kernels(kernel_level, threshold_factor_for(format, payload_threshold_factor()), selected_mask_factor, kernels, format);
 }
 
-int whisper_engine::decode_data_byte(uint8_t &data_byte)
+size_t whisper_engine::unpack_available(sample_source& from)
 {
-	int16_t sample = 0;
-	infile.read((char*)&sample, sizeof(sample));
-	auto status = infile.rdstate();
+	size_t count = min(from.available(), wide_samples.size());
+
+	unpack_samples(from.packed_samples(), wide_samples.data(), count);
+	return count;
+}
 
-	uint8_t bit_pos = 1;
-	uint8_t index = 0;
+// Like the kernels, on the samples from has available, which are consumed as far as they are used.
+size_t whisper_engine::extract_available(const kernel_set& set, sample_source& from, uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	size_t used = 0;
 
-	int16_t threshold = 0x800;
+	if (carrier_format == sample_int16)
+		used = extract_samples(set, from.samples(), from.available(), data, bit_index, bit_count);
+	else if (carrier_format == sample_float64)
+		used = set.extract_wide64(wide_samples.data(), unpack_available(from), data, bit_index, bit_count);
+	else
+		used = set.extract_wide((int32_t*)wide_samples.data(), unpack_available(from), data, bit_index, bit_count);
+	from.consume(used);
+	return used;
+}
 
-	data_byte = 0;
+uint64_t whisper_engine::count_available(sample_source& from)
+{
+	uint64_t eligible = 0;
 
-	while (!status) 
+	if (carrier_format == sample_int16)
 	{
-		int16_t absamp = abs(sample);
-		if (absamp >= threshold)
-		{
-			if (absamp & 1)
-			{
-				data_byte |= bit_pos;
-			}
-			bit_pos <<= 1;
-			if (!bit_pos)
-			{
-				return ios_base::goodbit;
-			}
-		}
-		infile.read((char*)&sample, sizeof(sample));
-		status = infile.rdstate();
+		eligible = count_samples(from.samples(), from.available());
+		from.consume(from.available());
+		return eligible;
 	}
+	while (from.available())
+	{
+		size_t count = unpack_available(from);
+		if (carrier_format == sample_float64)
+			eligible += kernels.count_wide64(wide_samples.data(), count);
+		else
+			eligible += kernels.count_wide((int32_t*)wide_samples.data(), count);
+		from.consume(count);
+	}
+	return eligible;
+}
+
+size_t whisper_engine::histogram_available(sample_source& from, uint64_t* at_least)
+{
+	size_t done = 0;
+
+	if (carrier_format == sample_int16)
+	{
+		done = from.available();
+		histogram_span(from.samples(), done, at_least);
+		from.consume(done);
+		return done;
+	}
+	while (from.available())
+	{
+		size_t count = unpack_available(from);
+		histogram_wide(wide_samples.data(), count, carrier_format, at_least);
+		from.consume(count);
+		done += count;
+	}
+	return done;
+}
+
+int whisper_engine::decode_whisper_metadata()
+{
+	begin_stage(stage_metadata);
+	int status = extract_bytes(metadata_kernels, (uint8_t*)&fixed_fields, sizeof(fixed_fields));
+
+	string m;
 
-	if (bit_pos)
+	for (uint32_t index = 0; index < 7; index++)
 	{
-		cout << "Unexpected EOF" << endl;
+		m += (char) fixed_fields.magic[index];
+	}
+	if (m != "WHISPER")
+	{
+		*messages << "No whisper data found" << endl;
+		close_files();
+		throw whisper_error(whisper_no_hidden_data);
+	}
+	else
+	{
+		*messages << "Identified whisper content" << endl;
+	}
+
+	if (fixed_fields.attribits.metadata_version > newest_metadata_version)
+	{
+		*messages << "Unsupported whisper metadata version " << fixed_fields.attribits.metadata_version << endl;
+		close_files();
+		throw whisper_error(whisper_unsupported_media);
+	}
+	extended_fields = { 0 };
+	if (fixed_fields.attribits.metadata_version)
+		status = extract_bytes(metadata_kernels, (uint8_t*)&extended_fields, sizeof(extended_fields));
+
+	uint32_t mask_factor = fixed_fields.attribits.mask_factor ? fixed_fields.attribits.mask_factor : 1;
+	uint32_t threshold_factor = fixed_fields.attribits.explicit_threshold ? fixed_fields.attribits.threshold_factor : metadata_kernels.threshold_factor;
+	if (mask_factor > max_mask_factor || !select_kernels(kernel_level, threshold_factor, mask_factor, kernels, carrier_format))
+	{
+		*messages << "Unsupported threshold factor " << threshold_factor << " or bits per sample " << mask_factor << endl;
 		close_files();
-		exit(-1);
+		throw whisper_error(whisper_unsupported_media);
 	}
 
 	return status;
 }
 
+int whisper_engine::decode_whisper_embedded_filename()
+{
+	uint32_t filename_size = fixed_fields.attribits.filename_size;
+
+	begin_stage(stage_filename);
+	filename.assign(filename_size, '\0');
+	return extract_bytes(kernels, (uint8_t*)&filename[0], filename_size);
+}
+
+int whisper_engine::decode_data_byte(uint8_t &data_byte)
+{
+	return extract_bytes(kernels, &data_byte, 1);
+}
+
 int whisper_engine::decode_data()
 {
 	WavMetadata wav_metadata = { 0 };
 
+	begin_stage(stage_header);
 	auto status = read_wav_metadata(wav_metadata);
 
 	if (status)
 	{
-		cout << "WAV metadata read error" << endl;
+		*messages << "WAV metadata read error" << endl;
 		return status;
 	}
 
@@ -149,7 +573,7 @@ int whisper_engine::decode_data()
 
 	if (status)
 	{
-		cout << "WHISPER metadata decode error" << endl;
+		*messages << "WHISPER metadata decode error" << endl;
 		return status;
 	}
 
@@ -157,29 +581,47 @@ int whisper_engine::decode_data()
 
 	if (status)
 	{
-		cout << "WHISPER filename decode error" << endl;
+		*messages << "WHISPER filename decode error" << endl;
 		return status;
 	}
+	end_stage();
+
+	if (out_dataspan.data)
+	{
+		if (out_dataspan.size < data_byte_count())
+		{
+			*messages << "The hidden data needs " << data_byte_count() << " bytes of output space" << endl;
+			return failed(whisper_buffer_too_small);
+		}
+	}
+	else if (out_datastream)
+	{
+		*messages << "Decoding " << filename << endl;
+	}
+	else
+	{
+		datafilepath /= filename;
+		check_output_claim(datafilepath);
 
-	datafilepath /= filename;
+		*messages << "Creating file " << filename << endl;
 
-	cout << "Creating file " << filename << endl;
+		datafile.open(datafilepath, std::fstream::binary | std::fstream::out | std::fstream::trunc);
 
-	datafile.open(datafilepath, std::fstream::binary | std::fstream::out | std::fstream::trunc);
-	
-	if (datafile.fail() || datafile.bad())
-	{
-		infile.close();
-		datafile.close();
-		exit(- 1);
+		if (datafile.fail() || datafile.bad())
+		{
+			infile.close();
+			datafile.close();
+			throw whisper_error(whisper_file_error);
+		}
 	}
 
 	status = decode_hidden_data();
+	end_stage();
 
 	if (status)
 	{
-		cout << "Hidden data decode error" << endl;
-		exit(-1);
+		*messages << "Hidden data decode error" << endl;
+		throw whisper_error(whisper_read_error);
 	}
 
 	return status;
@@ -187,416 +629,1119 @@ int whisper_engine::decode_data()
 
 int whisper_engine::encode_data()
 {
-	int status = 0;
-
-	fixed_fields.data_byte_count = filesystem::file_size(datafilepath);
-
-	filename = datafilepath.filename().string();
-	
 	if (filename.length() >= 1023  ||  filename.length() < 1)
 	{
-		cout << "Datafile name must have fewer than 1023 characters" << endl;
-		exit(- 1);
+		*messages << "Datafile name must have fewer than 1023 characters" << endl;
+		throw whisper_error(whisper_invalid_argument);
 	}
 
 	copy_wav_metadata();
-	write_whisper_metadata();
-	write_whisper_embedded_filename();
-	write_hidden_data();
-	copy_remaining_samples();
+
+	// a streamed carrier cannot be checked ahead of time, so running out of samples shows up here
+	if (write_whisper_metadata() || write_whisper_embedded_filename() || write_hidden_data())
+	{
+		*messages << "Not enough space in the media input for the data" << endl;
+		close_files();
+		return failed(whisper_not_enough_space);
+	}
+
+	int status = copy_remaining_samples();
+	end_stage();
 	close_files();
-	return 0;
+	return status;
 }
 
 void whisper_engine::close_files()
 {
+	sink.detach();
+	if (out_musicstream)
+		out_musicstream->flush();
+	if (out_datastream)
+		out_datastream->flush();
+	source.detach();
+	media_reader.close();
+	media_writer.close();
+	infile_map.close();
+	outfile_map.close();
 	infile.close();
 	outfile.close();
 	datafile.close();
+	if (buffers)
+		payload.release();
+}
+
+void whisper_engine::reset()
+{
+	close_files();
+	remove_spool_file();
+	infile.clear();
+	outfile.clear();
+	datafile.clear();
+	clear_job_state();
+}
+
+void whisper_engine::clear_job_state()
+{
+	fixed_fields = { { 'W','H','I','S','P','E','R' }, {0}, 0 };
+	fixed_fields.attribits.threshold_factor = 8;
+	fixed_fields.attribits.sample_bits_select = 1;
+	fixed_fields.attribits.skip_min_neg_sample_value = true;
+	extended_fields = { 0 };
+	datafilepath.clear();
+	filename.clear();
+	infilepath.clear();
+	outfilepath.clear();
+	wav_metadata = { 0 };
+	wav_header.clear();
+	probe_header.clear();
+	carrier_format = sample_int16;
+	unpack_samples = nullptr;
+	pack_samples = nullptr;
+	in_musicstream = nullptr;
+	out_musicstream = nullptr;
+	in_datastream = nullptr;
+	out_datastream = nullptr;
+	spooled_data.str("");
+	spooled_data.clear();
+	spooled_bytes = 0;
+	error_status = whisper_ok;
+	in_musicspan = { 0 };
+	out_musicspan = { 0 };
+	in_dataspan = { 0 };
+	out_dataspan = { 0 };
+	delta_output = false;
+	claim_output = nullptr;
+	start_job_stats(false);
+	set_kernel_level(kernel_level);		// drops kernels picked for the last carrier
+}
+
+void whisper_engine::check_output_claim(const filesystem::path& file_path)
+{
+	if (claim_output && !claim_output(file_path))
+	{
+		*messages << "Another job writes " << file_path.string() << endl;
+		close_files();
+		throw whisper_error(whisper_file_error);
+	}
+}
+
+void whisper_engine::start_job_stats(bool encode)
+{
+	job_stats = { encode };
+	current_stage = stage_count;
+	stage_counters = { 0 };
+	direct_bytes_read = 0;
+	direct_bytes_written = 0;
+	direct_io_calls = 0;
+}
+
+// Running totals of the I/O of the job, which a stage takes the difference of. The source and
+// sink keep their position when detached, so a stage may close the files before it ends.
+stage_stats whisper_engine::io_counters() const
+{
+	stage_stats counters = { 0 };
+
+	counters.bytes_read = source.position() + direct_bytes_read;
+	counters.bytes_written = sink.position() + direct_bytes_written;
+	counters.io_calls = source.reads() + sink.writes() + direct_io_calls;
+	return counters;
+}
+
+void whisper_engine::begin_stage(stats_stage stage)
+{
+	end_stage();
+	current_stage = stage;
+	stage_counters = io_counters();
+	stage_start = std::chrono::steady_clock::now();
+}
+
+void whisper_engine::end_stage()
+{
+	if (current_stage == stage_count)
+		return;
+
+	stage_stats& stats = job_stats.stages[current_stage];
+	stage_stats counters = io_counters();
+
+	stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - stage_start).count();
+	stats.bytes_read += counters.bytes_read - stage_counters.bytes_read;
+	stats.bytes_written += counters.bytes_written - stage_counters.bytes_written;
+	stats.io_calls += counters.io_calls - stage_counters.io_calls;
+	current_stage = stage_count;
+}
+
+// A field of byte_count bytes gone in or out over samples carrier samples.
+void whisper_engine::count_field(const kernel_set& set, size_t byte_count, uint64_t samples)
+{
+	if (current_stage == stage_count)
+		return;
+
+	stage_stats& stats = job_stats.stages[current_stage];
+
+	stats.samples_scanned += samples;
+	stats.eligible_samples += field_samples(set, byte_count);
+	stats.bits += 8 * (uint64_t)byte_count;
 }
 
 int whisper_engine::open_files_for_decoding()
+{
+	start_job_stats(false);
+
+	if (!infilepath.empty() && datafilepath == infilepath)
+	{
+		*messages << "Data and media files must be different" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+
+	if (in_musicspan.data)
+	{
+		source.attach(in_musicspan.data, in_musicspan.size);
+		return 0;
+	}
+
+	if (media_is_mappable())
+	{
+		if (!infile_map.open_read(infilepath))
+		{
+			infile_map.close();
+			*messages << "Could not map " << infilepath << endl;
+			throw whisper_error(whisper_file_error);
+		}
+		source.attach(infile_map.data(), infile_map.size());
+		return 0;
+	}
+
+	if (!in_musicstream)
+	{
+		infile.open(infilepath, std::fstream::binary | std::fstream::in);
+
+		if (infile.eof() || infile.fail() || infile.bad())
+		{
+			infile.close();
+			*messages << "Could not open " << infilepath << endl;
+			throw whisper_error(whisper_file_error);
+		}
+	}
+
+	if (!attach_media_input(source, media_reader, media_input()))
+	{
+		*messages << "Could not allocate I/O buffers" << endl;
+		close_files();
+		throw whisper_error(whisper_out_of_memory);
+	}
+
+	return 0;
+}
+
+// The carrier file is read through a block_reader with io_async. Otherwise, given more than one
+// thread, a reader thread of its own reads stream ahead into a pool of blocks while this one works
+// on the last block it handed over, and a writer thread drains the output behind it in the same
+// way; with one thread, the stream is read and written in turn with the work.
+bool whisper_engine::attach_media_input(sample_source& to, block_reader& reader, std::istream& stream)
+{
+	if (media_reads_async())
+		return reader.open(infilepath, io_block_bytes, default_io_queue_depth) && to.attach(reader);
+	if (thread_count > 1)
+		return reader.open(stream, io_block_bytes, default_io_queue_depth) && to.attach(reader);
+	return to.attach(stream, io_block_bytes);
+}
+
+bool whisper_engine::attach_media_output(sample_sink& to, block_writer& writer, std::ostream& stream)
+{
+	if (media_writes_async())
+		return writer.open(outfilepath, 0, io_block_bytes, default_io_queue_depth) && to.attach(writer);
+	if (thread_count > 1 && !delta_output)
+		return writer.open(stream, io_block_bytes, default_io_queue_depth) && to.attach(writer);
+	return to.attach(stream, io_block_bytes);
+}
+
+
+int whisper_engine::open_files_for_encoding() 
 {
 	set<path> unique_names;
-	unique_names.insert(datafilepath);
-	unique_names.insert(infilepath);
+	size_t named_files = 0;
+
+	start_job_stats(true);
+
+	for (auto file_path : { datafilepath, infilepath, media_in_place() ? path() : outfilepath })
+	{
+		if (!file_path.empty())
+		{
+			unique_names.insert(file_path);
+			named_files++;
+		}
+	}
+
+	if (unique_names.size() != named_files)
+	{
+		*messages << "Each filename must be unique. Try again. " << endl;
+ 		throw whisper_error(whisper_invalid_argument);
+	}
+	if (!out_musicstream && !out_musicspan.data)
+		check_output_claim(outfilepath);
+
+	if (media_is_mappable())
+	{
+		if (!infile_map.open_read(infilepath))
+		{
+			*messages << "Failed to map media input file: " << infilepath.string() << endl;
+			infile_map.close();
+			return failed(whisper_file_error);
+		}
+	}
+	else if (!in_musicstream && !in_musicspan.data)
+	{
+		infile.open(infilepath, std::fstream::binary | std::fstream::in); 
+
+		if (infile.eof() || infile.fail() || infile.bad())
+		{
+			*messages << "Failed to open media input file: " << infilepath.string() << endl;
+			infile.close();
+			return failed(whisper_file_error);
+		}
+	}
+
+	if (in_dataspan.data)
+	{
+		set_data_byte_count(in_dataspan.size);
+	}
+	else if (in_datastream)
+	{
+		set_data_byte_count(spooled_bytes);
+	}
+	else
+	{
+		datafile.open(datafilepath, std::fstream::binary | std::fstream::in);
+
+		if (datafile.eof() || datafile.fail() || datafile.bad())
+		{
+			*messages << "Failed to open data file: " << datafilepath.string() << endl;
+			close_files();
+			return failed(whisper_file_error);
+		}
+
+		filename = datafilepath.filename().string();
+		set_data_byte_count(filesystem::file_size(datafilepath));
+	}
+	fixed_fields.attribits.filename_size = filename.length();
+
+	select_kernels(kernel_level, payload_threshold_factor(), selected_mask_factor, kernels);
+	if (!selected_threshold_factor && in_musicstream)
+	{
+		*messages << "The threshold cannot be chosen ahead of a streamed carrier; using " << (1 << kernels.threshold_factor) << endl;
+	}
+	if (!in_musicstream)
+	{
+		begin_stage(stage_capacity_check);
+		int status = check_capacity(field_samples(kernels, filename.length()) + field_samples(kernels, data_byte_count()));
+		end_stage();
+		if (status)
+		{
+			close_files();
+			return -1;
+		}
+		if (delta_output && carrier_format != sample_int16)
+		{
+			*messages << "Deltas can only be made against 16-bit carriers" << endl;
+			close_files();
+			throw whisper_error(whisper_unsupported_media);
+		}
+	}
+
+	if (media_is_mappable())
+	{
+		size_t outfile_size = encoded_size(infile_map.size());
+
+		if (!outfile_map.create(outfilepath, outfile_size))
+		{
+			*messages << "Failed to create media output file: " << outfilepath.string() << endl;
+			close_files();
+			throw whisper_error(whisper_file_error);
+		}
+		source.attach(infile_map.data(), infile_map.size());
+		sink.attach(outfile_map.data(), outfile_map.size());
+		return 0;
+	}
+
+	if (out_musicspan.data && in_musicspan.data && out_musicspan.size < encoded_size(in_musicspan.size))
+	{
+		*messages << "The encoded media needs " << encoded_size(in_musicspan.size) << " bytes of output space" << endl;
+		close_files();
+		return failed(whisper_buffer_too_small);
+	}
+
+	if (media_is_patchable())
+	{
+		if (!media_in_place() && !clone_file(infilepath, outfilepath, io_block_bytes))
+		{
+			*messages << "Failed to clone the media input file to " << outfilepath.string() << endl;
+			close_files();
+			throw whisper_error(whisper_file_error);
+		}
+		outfile.open(outfilepath, std::fstream::binary | std::fstream::in | std::fstream::out);
+
+		if (outfile.fail() || outfile.bad())
+		{
+			*messages << "Failed to open media output file: " << outfilepath.string() << endl;
+			close_files();
+			throw whisper_error(whisper_file_error);
+		}
+	}
+	else if (!out_musicstream && !out_musicspan.data && !delta_output)	// a delta file is created once it is complete
+	{
+		outfile.open(outfilepath, std::fstream::binary | std::fstream::out | std::fstream::trunc);
+
+		if (outfile.fail() || outfile.bad())
+		{
+			*messages << "Failed to create media output file: " << outfilepath.string() << endl;
+			close_files();
+			throw whisper_error(whisper_file_error);
+		}
+	}
+
+	bool attached = in_musicspan.data ? source.attach(in_musicspan.data, in_musicspan.size) : attach_media_input(source, media_reader, media_input());
+
+	if (out_musicspan.data)
+		attached = attached && sink.attach(out_musicspan.data, out_musicspan.size);
+	else
+		attached = attached && attach_media_output(sink, media_writer, delta_output ? discard_stream : out_musicstream ? *out_musicstream : outfile);
+
+	if (!attached)
+	{
+		*messages << "Could not allocate I/O buffers" << endl;
+		close_files();
+		throw whisper_error(whisper_out_of_memory);
+	}
+
+	return 0;
+}
+
+int whisper_engine::open_files_for_analysis()
+{
+	if (in_musicspan.data)
+	{
+		source.attach(in_musicspan.data, in_musicspan.size);
+		return 0;
+	}
+
+	if (media_is_mappable())
+	{
+		if (!infile_map.open_read(infilepath))
+		{
+			infile_map.close();
+			*messages << "Could not map " << infilepath << endl;
+			return failed(whisper_file_error);
+		}
+		source.attach(infile_map.data(), infile_map.size());
+		return 0;
+	}
+
+	if (!in_musicstream)
+		infile.open(infilepath, std::fstream::binary | std::fstream::in);
+
+	if (media_input().eof() || media_input().fail() || media_input().bad() || !attach_media_input(source, media_reader, media_input()))
+	{
+		infile.close();
+		*messages << "Could not open " << infilepath << endl;
+		return failed(whisper_file_error);
+	}
+
+	return 0;
+}
+
+// Eligible samples taken by a field of byte_count bytes, which starts on a fresh sample.
+uint64_t whisper_engine::field_samples(const kernel_set& set, uint64_t byte_count)
+{
+	return (8 * byte_count + set.payload_bits - 1) / set.payload_bits;
+}
+
+// Reads ahead through the carrier, on its own stream, past the whisper metadata and then until
+// needed_samples eligible samples are found for the filename and data, so that encoding can be
+// refused before the output file is created. With the threshold left to the engine, the rest of
+// the carrier goes through the magnitude histogram instead, and the highest threshold at which
+// the filename and data still fit is selected.
+int whisper_engine::check_capacity(uint64_t needed_samples)
+{
+	std::fstream probe;
+	block_reader probe_reader;
+	sample_source probe_source;
+	WavMetadata probe_metadata = { 0 };
+
+	probe_reader.set_pool(buffers);
+	probe_source.set_pool(buffers);
+
+	if (in_musicspan.data)
+	{
+		probe_source.attach(in_musicspan.data, in_musicspan.size);
+	}
+	else if (media_is_mappable())
+	{
+		probe_source.attach(infile_map.data(), infile_map.size());
+	}
+	else
+	{
+		probe.open(infilepath, std::fstream::binary | std::fstream::in);
+		if (probe.fail() || !attach_media_input(probe_source, probe_reader, probe))
+		{
+			*messages << "Failed to open media input file: " << infilepath.string() << endl;
+			return failed(whisper_file_error);
+		}
+	}
+
+	if (!parse_wav_chunks(probe_source, probe_metadata, probe_header))
+	{
+		*messages << "WAV metadata read error " << endl;
+		return failed(whisper_read_error);
+	}
+	validate_wav_metadata(probe_metadata);
+	set_carrier_format(probe_metadata, probe_source);
+
+	uint8_t skipped_bytes[sizeof(fixed_metadata) + sizeof(extended_metadata)] = { 0 };
+	uint64_t bit_index = 0;
+	uint64_t bit_count = 8 * metadata_bytes();
+	uint64_t found = 0;
+
+	while (probe_source.fill() && bit_index < bit_count)
+		extract_available(metadata_kernels, probe_source, skipped_bytes, bit_index, bit_count);
+
+	if (bit_index == bit_count && !selected_threshold_factor)
+	{
+		uint64_t at_least[wide_magnitude_classes] = { 0 };
+
+		while (probe_source.fill())
+			histogram_available(probe_source, at_least);
+
+		for (uint32_t threshold_factor = threshold_factor_for(carrier_format, max_threshold_factor);
+			threshold_factor >= max(threshold_factor_for(carrier_format, min_threshold_factor), selected_mask_factor); threshold_factor--)
+		{
+			found = at_least[threshold_factor];
+			if (found >= needed_samples)
+			{
+				select_kernels(kernel_level, threshold_factor, selected_mask_factor, kernels, carrier_format);
+				*messages << "Using threshold " << threshold_text(carrier_format, threshold_factor) << endl;
+				break;
+			}
+		}
+	}
+
+	while (bit_index == bit_count && found < needed_samples && probe_source.fill())
+		found += count_available(probe_source);
+
+	// the probe bypasses the engine's source, so its reads are counted here
+	stage_stats& probed = job_stats.stages[stage_capacity_check];
+	probed.samples_scanned += (probe_source.position() - probe_header.size()) / probe_source.sample_size();
+	probed.eligible_samples += found;
+	probed.bytes_read += probe_source.position();
+	probed.io_calls += probe_source.reads();
+
+	if (found < needed_samples)
+	{
+		*messages << "Not enough space in " << infilepath.string() << ": " << needed_samples << " eligible samples needed, "
+			<< found << " available" << endl;
+		return failed(whisper_not_enough_space);
+	}
+	return 0;
+}
+
+int whisper_engine::analyze_capacity(capacity_report& report) // expects an open media file and does not close it
+{
+	WavMetadata wav_metadata = { 0 };
+	uint8_t metadata_bytes[sizeof(fixed_metadata)] = { 0 };
+	uint64_t bit_index = 0;
+	uint64_t bit_count = 8 * sizeof(metadata_bytes);
+
+	read_wav_metadata(wav_metadata);
+	validate_wav_metadata(wav_metadata);
+
+	report = { 0 };
+
+	report.format = carrier_format;
+
+	// the whisper metadata always goes in first, at the default threshold
+	while (source.fill() && bit_index < bit_count)
+		report.metadata_samples += extract_available(metadata_kernels, source, metadata_bytes, bit_index, bit_count);
+	report.sample_count = report.metadata_samples;
+	report.metadata_fits = bit_index == bit_count;
+
+	while (source.fill())
+		report.sample_count += histogram_available(source, report.at_least);
+	return 0;
+}
+
+uint64_t whisper_engine::capacity_bytes(const capacity_report& report, uint32_t threshold_factor, uint32_t mask_factor)
+{
+	if (!report.metadata_fits || threshold_factor >= (uint32_t)wide_magnitude_classes || mask_factor > threshold_factor)
+		return 0;
+	return report.at_least[threshold_factor] * max<uint32_t>(mask_factor, 1) / 8;
+}
+
+// Floating-point thresholds are fractions of full scale, which is 1.0.
+string whisper_engine::threshold_text(sample_format format, uint32_t threshold_factor)
+{
+	if (sample_format_is_float(format))
+		return "2^" + to_string((int)threshold_factor - 15);
+	return to_string(1u << threshold_factor);
+}
+
+int whisper_engine::report_capacity()
+{
+	capacity_report report;
+	int status = analyze_capacity(report);
+
+	if (status)
+		return status;
+
+	*messages << "Carrier: " << (in_musicstream ? "(stream)" : infilepath.string()) << endl;
+	*messages << "Samples: " << report.sample_count << " (whisper metadata takes the first " << report.metadata_samples << ")" << endl;
+
+	if (!report.metadata_fits)
+	{
+		*messages << "Not enough eligible samples for the whisper metadata" << endl;
+		return 0;
+	}
+
+	*messages << "Usable bytes for file name and data:" << endl;
+	*messages << "  factor  threshold     eligible        1 bit       2 bits       3 bits       4 bits" << endl;
+
+	// factors as --threshold takes them; for other formats, the threshold itself differs
+	for (uint32_t factor = min_threshold_factor; factor <= max_threshold_factor; factor++)
+	{
+		uint32_t threshold_factor = threshold_factor_for(report.format, factor);
+
+		*messages << (factor == payload_threshold_factor() ? "* " : "  ") << setw(6) << factor << setw(11) << threshold_text(report.format, threshold_factor)
+			<< setw(13) << report.at_least[threshold_factor];
+		for (uint32_t mask_factor = 1; mask_factor <= 4; mask_factor++)
+		{
+			if (mask_factor > factor)
+				*messages << setw(13) << "-";
+			else
+				*messages << setw(13) << capacity_bytes(report, threshold_factor, mask_factor);
+		}
+		*messages << endl;
+	}
+	*messages << "* threshold used by the encoder" << endl;
+	return 0;
+}
+
+// Between files, the untouched tail of the carrier is copied by the system in one go, leaving
+// the remaining samples unread, or is already in place when patching; elsewhere it goes through
+// the sample source and sink. A delta needs no tail at all, only the carrier's size, and its
+// file is created here, so that a failed encode leaves nothing behind.
+int whisper_engine::copy_remaining_samples() 
+{
+	stage_stats& tail = job_stats.stages[stage_tail];
+
+	begin_stage(stage_tail);
+	if (delta_output)
+	{
+		uint64_t carrier_bytes = 0;
+
+		if (infile.is_open())
+		{
+			carrier_bytes = filesystem::file_size(infilepath);
+		}
+		else
+		{
+			for (size_t available = source.fill(); available; available = source.fill())
+			{
+				source.consume(available);
+				tail.samples_scanned += available;
+			}
+			for (size_t available = source.fill_bytes(); available; available = source.fill_bytes())
+				source.consume_bytes(available);
+			carrier_bytes = source.position();
+		}
+
+		if (!out_musicstream && !out_musicspan.data)
+		{
+			outfile.open(outfilepath, std::fstream::binary | std::fstream::out | std::fstream::trunc);
+
+			if (outfile.fail() || outfile.bad())
+			{
+				*messages << "Failed to create delta output file: " << outfilepath.string() << endl;
+				close_files();
+				return failed(whisper_file_error);
+			}
+		}
 
-	if (unique_names.size() != 2)
-	{
-		cout << "Data and media files must be different" << endl;
-		exit (-1);
-	}
+		bool written = delta.finish(out_musicstream ? *out_musicstream : outfile, carrier_bytes);
 
-	infile.open(infilepath, std::fstream::binary | std::fstream::in); 
+		close_files();
+		if (!written)
+		{
+			*messages << "File write error" << endl;
+			return failed(whisper_write_error);
+		}
+		return 0;
+	}
 
-	if (infile.eof() || infile.fail() || infile.bad())
+	if (media_is_patchable())
 	{
-		infile.close();
-		cout << "Could not open " << infilepath << endl;
-		exit(-1);
-	}
+		bool written = sink.flush() && outfile.flush();
 
-	return 0;
-}
+		close_files();
+		if (!written)
+		{
+			*messages << "File write error" << endl;
+			return failed(whisper_write_error);
+		}
+		return 0;
+	}
 
+	if (infile.is_open() && outfile.is_open())
+	{
+		uint64_t offset = source.position();
+		uint64_t carrier_bytes = filesystem::file_size(infilepath);
+		uint64_t tail_bytes = offset < carrier_bytes ? carrier_bytes - offset : 0;
 
-int whisper_engine::open_files_for_encoding() 
-{
-	set<path> unique_names;
-	unique_names.insert(datafilepath);
-	unique_names.insert(infilepath);
-	unique_names.insert(outfilepath);
+		if (!sink.flush() || !outfile.flush())
+		{
+			*messages << "File write error" << endl;
+			close_files();
+			return failed(whisper_write_error);
+		}
+		close_files();
 
-	if (unique_names.size() != 3)
-	{
-		cout << "Each filename must be unique. Try again. " << endl;
- 		exit(- 1);
+		if (!copy_file_range_at(infilepath, outfilepath, offset, tail_bytes, io_block_bytes, &direct_io_calls))
+		{
+			*messages << "File write error" << endl;
+			return failed(whisper_write_error);
+		}
+		direct_bytes_read += tail_bytes;
+		direct_bytes_written += tail_bytes;
+		return 0;
 	}
 
-	infile.open(infilepath, std::fstream::binary | std::fstream::in); 
+	size_t available = source.fill();
 
-	if (infile.eof() || infile.fail() || infile.bad())
+	while (available)
 	{
-		cout << "Failed to open media input file: " << infilepath.string() << endl;
-		infile.close();
-		return -1;
+		if (!sink.write(source.samples(), available * source.sample_size()))
+		{
+			*messages << "File write error" << endl; 
+			close_files();
+			return failed(whisper_write_error);
+		}
+		source.consume(available);
+		tail.samples_scanned += available;
+		available = source.fill();
 	}
 
-	datafile.open(datafilepath, std::fstream::binary | std::fstream::in);
-
-	if (datafile.eof() || datafile.fail() || datafile.bad())
+	// whatever follows the data chunk
+	for (available = source.fill_bytes(); available; available = source.fill_bytes())
 	{
-		cout << "Failed to open data file: " << datafilepath.string() << endl;
-		infile.close();
-		datafile.close();
-		return -1;
+		if (!sink.write(source.bytes(), available))
+		{
+			*messages << "File write error" << endl; 
+			close_files();
+			return failed(whisper_write_error);
+		}
+		source.consume_bytes(available);
 	}
 
-	filename = datafilepath.filename().string();
-	fixed_fields.attribits.filename_size = filename.length();
-	fixed_fields.data_byte_count = filesystem::file_size(datafilepath);
-
-	outfile.open(outfilepath, std::fstream::binary | std::fstream::out | std::fstream::trunc);
+	if (media_input().bad() || source.read_failed())
+	{
+		*messages << "File read error " << endl;
+		close_files();
+		throw whisper_error(whisper_read_error);
+	}
 
-	if (outfile.fail() || outfile.bad())
+	if (!sink.flush())
 	{
-		cout << "Failed to create media output file: " << outfilepath.string() << endl;
+		*messages << "File write error" << endl;
 		close_files();
-		exit (-1);
+		return failed(whisper_write_error);
 	}
 
+	close_files();
 	return 0;
 }
 
-std::ios_base::fmtflags whisper_engine::copy_remaining_samples() 
+// Walks the chunks of a RIFF/WAVE file in order up to the data chunk, collecting every byte on
+// the way in header, and leaves from at the first sample, limited to the samples of the data
+// chunk. Chunks other than fmt are passed over whatever they are; so is anything after the data.
+// WAVE_FORMAT_EXTENSIBLE is reported as the format of its SubFormat, and RF64/BW64 take the size
+// of the data from their ds64 chunk.
+bool whisper_engine::parse_wav_chunks(sample_source& from, WavMetadata& metadata, std::string& header)
 {
-	int16_t sample = 0;
-	infile.read((char*)&sample, sizeof(sample));
-	auto state = infile.rdstate();
+	static const uint8_t subformat_tail[14] = { 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+	DataHeader chunk = { 0 };
+	DataSize64Chunk sizes = { 0 };
+	bool have_format = false;
+	bool have_sizes = false;
+
+	metadata = { 0 };
+	header.clear();
+
+	if (!from.read_bytes(&metadata.riff, sizeof(metadata.riff)) || memcmp(metadata.riff.format, "WAVE", 4)
+		|| (memcmp(metadata.riff.id, "RIFF", 4) && memcmp(metadata.riff.id, "RF64", 4) && memcmp(metadata.riff.id, "BW64", 4)))
+	{
+		*messages << "Not a RIFF/WAVE, RF64 or BW64 file" << endl;
+		return false;
+	}
+	header.append((const char*)&metadata.riff, sizeof(metadata.riff));
 
-	while (!state) 
+	for (;;)
 	{
-		outfile.write((const char*)&sample, sizeof(sample));
-		if (outfile.bad()  || outfile.fail())
+		if (!from.read_bytes(&chunk, sizeof(chunk)))
 		{
-			cout << "File write error" << endl; 
-			close_files();
-			return -1;
+			*messages << "No data chunk in the WAV file" << endl;
+			return false;
 		}
-		infile.read((char*)&sample, sizeof(sample));
-		state = infile.rdstate();
-		if (infile.eof())
+		header.append((const char*)&chunk, sizeof(chunk));
+
+		if (!memcmp(chunk.id, "data", 4))
+			break;
+
+		uint64_t body_bytes = (uint64_t)(uint32_t)chunk.size + (chunk.size & 1);	// chunks are padded to even sizes
+		size_t body_begin = header.size();
+
+		while (body_bytes)
 		{
-			close_files();
-			return ios_base::goodbit;
+			char piece[4096];
+			size_t count = (size_t)min<uint64_t>(body_bytes, sizeof(piece));
+			if (!from.read_bytes(piece, count))
+			{
+				*messages << "WAV chunk " << string(chunk.id, 4) << " is cut short" << endl;
+				return false;
+			}
+			header.append(piece, count);
+			body_bytes -= count;
 		}
-		if (infile.fail() || infile.bad())
+
+		if (!memcmp(chunk.id, "fmt ", 4) && (uint32_t)chunk.size >= sizeof(FormatChunk) - sizeof(DataHeader))
 		{
-			cout << "File read error " << endl;
-			close_files();
-			exit(-1);
+			const char* body = header.data() + body_begin;
+
+			memcpy(&metadata.format, &chunk, sizeof(chunk));
+			memcpy((char*)&metadata.format + sizeof(chunk), body, sizeof(FormatChunk) - sizeof(chunk));
+			if (metadata.format.format == wave_format_extensible && chunk.size >= 40 && !memcmp(body + 26, subformat_tail, sizeof(subformat_tail)))
+				memcpy(&metadata.format.format, body + 24, sizeof(metadata.format.format));
+			have_format = true;
+		}
+		else if (!memcmp(chunk.id, "ds64", 4) && (uint32_t)chunk.size >= sizeof(DataSize64Chunk) - sizeof(DataHeader))
+		{
+			memcpy(&sizes, &chunk, sizeof(chunk));
+			memcpy((char*)&sizes + sizeof(chunk), header.data() + body_begin, sizeof(DataSize64Chunk) - sizeof(chunk));
+			have_sizes = memcmp(metadata.riff.id, "RIFF", 4) != 0;
 		}
 	}
 
-	close_files();
-	return state;
+	if (!have_format)
+	{
+		*messages << "No fmt chunk ahead of the WAV data" << endl;
+		return false;
+	}
+
+	// a size of 0xffffffff defers to ds64, or else, as written by some streaming recorders, runs to
+	// the end of the file
+	metadata.dataheader = chunk;
+	if ((uint32_t)chunk.size != 0xffffffff)
+		from.set_limit(from.position() + (uint32_t)chunk.size);
+	else if (have_sizes)
+		from.set_limit(from.position() + sizes.datasize);
+	return true;
 }
 
-std::ios_base::fmtflags whisper_engine::read_wav_metadata(WavMetadata &wav_metadata) 
+int whisper_engine::read_wav_metadata(WavMetadata &wav_metadata) 
 {
-	wav_metadata = { 0 };
-	infile.read((char*)&wav_metadata, sizeof(wav_metadata));
-	auto state = infile.rdstate();
-	if (state)
+	if (!parse_wav_chunks(source, wav_metadata, wav_header))
 	{
-		cout << "WAV metadata read error " << endl;
+		*messages << "WAV metadata read error " << endl;
 		close_files();
-		exit (-1);
+		throw whisper_error(whisper_read_error);
 	}
+	set_carrier_format(wav_metadata, source);
 
-	return state;
+	return 0;
 }
 
 
-std::ios_base::fmtflags whisper_engine::copy_wav_metadata() 
+void whisper_engine::validate_wav_metadata(const WavMetadata& wav_metadata)
 {
-	whisper::WavMetadata wav_metadata = { 0 };
-	auto state = read_wav_metadata(wav_metadata);
+	if (wav_metadata.format.format != wave_format_pcm && wav_metadata.format.format != wave_format_ieee_float)
+	{
+		*messages << "Source wav file: unsupported format. Not a PCM or IEEE float file. " << endl;
+		close_files();
+		throw whisper_error(whisper_unsupported_media);
+	}
 
-	if (state)
+	bool float_samples = wav_metadata.format.format == wave_format_ieee_float;
+	int16_t bits = wav_metadata.format.numsamplebits;
+	if (float_samples ? bits != 32 && bits != 64 : bits != 16 && bits != 24 && bits != 32)
 	{
+		*messages << "Unsupported bits-per-sample: " << wav_metadata.format.numsamplebits << endl;
 		close_files();
-		cout << "Error reading wav file metadata " << endl;
-		exit(-1);
+		throw whisper_error(whisper_unsupported_media);
 	}
 
-	if (wav_metadata.format.format != 1)
+	if (wav_metadata.format.alignment != wav_metadata.format.numchannels * wav_metadata.format.numsamplebits / 8)
 	{
-		cout << "Source wav file: unsupported format. Not a PCM file. " << endl;
+		*messages << "Incorrect sample alignmnet in WAV metadata" << endl;
 		close_files();
-		exit(-1);
+		throw whisper_error(whisper_unsupported_media);
 	}
+}
+
+int whisper_engine::copy_wav_metadata() 
+{
+	whisper::WavMetadata wav_metadata = { 0 };
+
+	begin_stage(stage_header);
+	auto state = read_wav_metadata(wav_metadata);
 
-	if (wav_metadata.format.numsamplebits % 8 || (wav_metadata.format.numsamplebits != 16))  // currently only 16-bit is supported
+	if (state)
 	{
-		cout << "Unsupported bits-per-sample: " << wav_metadata.format.numsamplebits << endl;
 		close_files();
-		exit(-1);
+		*messages << "Error reading wav file metadata " << endl;
+		throw whisper_error(whisper_read_error);
 	}
 
-	if (wav_metadata.format.alignment != wav_metadata.format.numchannels * wav_metadata.format.numsamplebits / 8)
+	validate_wav_metadata(wav_metadata);
+
+	if (delta_output && carrier_format != sample_int16)
 	{
-		cout << "Incorrect sample alignmnet in WAV metadata" << endl;
+		*messages << "Deltas can only be made against 16-bit carriers" << endl;
 		close_files();
-		exit(-1);
+		throw whisper_error(whisper_unsupported_media);
 	}
+	if (delta_output)
+		delta.begin(wav_header.data(), (uint32_t)wav_header.size(), kernels.payload_bits);
 
 	fixed_fields.attribits.sample_bits_select = (wav_metadata.format.numsamplebits / 8) - 1;  
 	fixed_fields.attribits.threshold_factor =    wav_metadata.format.numsamplebits / 2;  // default
-	fixed_fields.attribits.mask_factor = 0;  // default (this is the only supported value at this time
+	fixed_fields.attribits.explicit_threshold = kernels.threshold_factor != metadata_kernels.threshold_factor;
+	if (fixed_fields.attribits.explicit_threshold)
+		fixed_fields.attribits.threshold_factor = kernels.threshold_factor;
+	fixed_fields.attribits.mask_factor = kernels.payload_bits == 1 ? 0 : kernels.payload_bits;  // 0 is the one-bit default
 	fixed_fields.attribits.skip_min_neg_sample_value = true;
 	fixed_fields.attribits.ignore_sign = 0;
 
-	outfile.write((char*)&wav_metadata, sizeof(wav_metadata));
-	state = outfile.rdstate();
-	if (state)
+	if (!sink.write(wav_header.data(), wav_header.size()))
 	{
-		cout << "Failed to write WAV metadata " << endl;
+		*messages << "Failed to write WAV metadata " << endl;
 		close_files();
-		exit(-1);
+		throw whisper_error(whisper_write_error);
 	}
-	return state;
+	return 0;
 }
 
-std::ios_base::fmtflags whisper_engine::write_whisper_embedded_filename() // expects open files and does not close them
+int whisper_engine::write_whisper_embedded_filename() // expects open files and does not close them
 {
-	int16_t sample = 0;
-	infile.read((char*)&sample, sizeof(sample));
-
-	uint32_t str_size = datafilepath.filename().string().length();
-	const string tmp_filename = datafilepath.filename().string();
-
-	auto chrptr = tmp_filename.c_str();
-	uint8_t bit_pos = 1;
-	uint8_t index = 0;
-
-	int16_t threshold = 0x800;
-
-	while (!infile.rdstate()) 
-	{
-		int16_t absamp = abs(sample);
-		if (absamp >= threshold)
-		{
-			absamp &= ~1;
-			if (chrptr[index] & bit_pos)
-			{
-				absamp |= 1;
-			}
-			if (sample >= 0)
-			{
-				sample = absamp;
-			}
-			else
-			{
-				sample = -absamp;
-			}
-			bit_pos <<= 1;
-			if (!bit_pos)
-			{
-				index++;
-				bit_pos = 1;
-			}
-		}
-		outfile.write((const char*)&sample, sizeof(sample));
-		if (outfile.rdstate())
-			break;
-		if (index >= str_size)
-			return 0;
-		infile.read((char*)&sample, sizeof(sample));
-	}
+	begin_stage(stage_filename);
+	int status = embed_bytes(kernels, (const uint8_t*)filename.c_str(), filename.length());
 
-	if (index < sizeof(str_size))   // not enough sample space for filename
+	if (status)   // not enough sample space for filename
 	{
-		cout << "not enough space for filename" << endl;
-		return -1;
+		*messages << "not enough space for filename" << endl;
 	}
 
-	return infile.rdstate() | outfile.rdstate();
+	return status;
 }
 
-std::ios_base::fmtflags whisper_engine::write_whisper_metadata() // expects open files and does not close them
+int whisper_engine::write_whisper_metadata() // expects open files and does not close them
 {
-	int16_t sample = 0;
-	infile.read((char*)&sample, sizeof(sample));
+	begin_stage(stage_metadata);
+	int status = embed_bytes(metadata_kernels, (const uint8_t*)&fixed_fields, sizeof(fixed_fields));
+
+	if (!status && fixed_fields.attribits.metadata_version)
+		status = embed_bytes(metadata_kernels, (const uint8_t*)&extended_fields, sizeof(extended_fields));
+	return status;
+}
 
-	uint8_t* ptr_metadata = (uint8_t*)&fixed_fields;
-	uint8_t bit_pos = 1;
-	uint8_t md_index = 0;
+// A whole number of samples' worth of payload: with three bits per sample, a multiple of three bytes.
+size_t whisper_engine::payload_block_bytes()
+{
+	return payload.size() - payload.size() % kernels.payload_bits;
+}
 
-	int16_t threshold = 0x800;
+int whisper_engine::write_hidden_data() // expects open files and does not close them
+{
+	int status = 0;
 
-	while (!infile.rdstate()) 
+	begin_stage(stage_payload);
+	if (in_dataspan.data)
 	{
-		int16_t absamp = abs(sample);
-		if (absamp >= threshold)
-		{
-			absamp &= ~1;
-			if (ptr_metadata[md_index] & bit_pos)
-			{
-				absamp |= 1;
-			}
-			if (sample >= 0)
-			{
-				sample = absamp;
-			}
-			else
-			{
-				sample = -absamp;
-			}
-			bit_pos <<= 1;
-			if (!bit_pos) 
-			{
-				md_index++;
-				bit_pos = 1;
-			}
-		}
-		outfile.write((const char*)&sample, sizeof(sample));
-		if (outfile.rdstate())
-			break;
-		if (md_index >= sizeof(fixed_fields))
-			return 0;
-		infile.read((char*)&sample, sizeof(sample));
+		direct_bytes_read += in_dataspan.size;
+		return embed_bytes(kernels, (const uint8_t*)in_dataspan.data, in_dataspan.size);
 	}
 
-	if (md_index < sizeof(fixed_fields))   // not enough sample space for metadata
+	if (!payload.allocate(io_block_bytes))
 	{
-		return -1;
+		*messages << "Could not allocate I/O buffers" << endl;
+		return failed(whisper_out_of_memory);
 	}
 
-	return infile.rdstate() | outfile.rdstate();
-}
-
-std::ios_base::fmtflags whisper_engine::write_hidden_data() // expects open files and does not close them
-{
-	uint8_t single_datum; 
-	ios_base::iostate status = 0;
-	datafile.read((char *)&single_datum, sizeof(single_datum));
-	while (!(status = datafile.rdstate()))
+	while (!status)
 	{
-		status = write_single_hidden_datum(&single_datum, sizeof(single_datum));
-		if (status)
+		data_input().read(payload.data(), payload_block_bytes());
+		size_t count = (size_t)data_input().gcount();
+		direct_bytes_read += count;
+		direct_io_calls++;
+		if (!count)
 			break;
-		datafile.read((char *)&single_datum, sizeof(single_datum));
+		status = embed_bytes(kernels, (const uint8_t*)payload.data(), count);
 	}
 	return status;
 }
 
-std::ios_base::fmtflags whisper_engine::write_single_hidden_datum(uint8_t *data, int32_t data_width) // expects open files and does not close them
+int whisper_engine::write_single_hidden_datum(uint8_t *data, int32_t data_width) // expects open files and does not close them
 {
-	int16_t sample = 0;
 	if (data_width < 1)
 	{
 		return 0;
 	} 
-	infile.read((char*)&sample, sizeof(sample));
+	return embed_bytes(kernels, data, data_width);
+}
 
-	uint8_t* ptr_data = data;
-	uint8_t bit_pos = 1;
-	uint8_t index = 0;
 
-	int16_t threshold = 0x800;
+int whisper_engine::decode_hidden_data() // expects open files and does not close them
+{
+	uint64_t remaining = data_byte_count();
 
-	while (!infile.rdstate()) 
+	begin_stage(stage_payload);
+	if (out_dataspan.data)
 	{
-		int16_t absamp = abs(sample);
-		if (absamp >= threshold)
-		{
-			absamp &= ~1;
-			if (ptr_data[index] & bit_pos)
-			{
-				absamp |= 1;
-			}
-			if (sample >= 0)
-			{
-				sample = absamp;
-			}
-			else
-			{
-				sample = -absamp;
-			}
-			bit_pos <<= 1;
-			if (!bit_pos)
-			{
-				index++;
-				bit_pos = 1;
-			}
-		}
-		outfile.write((const char*)&sample, sizeof(sample));
-		if (outfile.rdstate())
-			break;
-		if (index >= data_width)
-			return 0;
-		infile.read((char*)&sample, sizeof(sample));
+		direct_bytes_written += remaining;
+		return extract_bytes(kernels, (uint8_t*)out_dataspan.data, (size_t)remaining);
 	}
 
-	if (index < data_width)   // not enough sample space for hidden data
+	if (!payload.allocate(io_block_bytes))
 	{
-		return -1;
+		*messages << "Could not allocate I/O buffers" << endl;
+		close_files();
+		throw whisper_error(whisper_out_of_memory);
 	}
 
-	return infile.rdstate() | outfile.rdstate();
-}
+	while (remaining)
+	{
+		size_t count = (size_t)min<uint64_t>(remaining, payload_block_bytes());
+		extract_bytes(kernels, (uint8_t*)payload.data(), count);
+		data_output().write(payload.data(), count);
+		direct_bytes_written += count;
+		direct_io_calls++;
+		if (data_output().rdstate())
+		{
+			*messages << "ERROR writing output" << endl;
+			close_files();
+			throw whisper_error(whisper_write_error);
+		}
+		remaining -= count;
+	}
 
+	return 0;
+}
 
-std::ios_base::fmtflags whisper_engine::decode_hidden_data() // expects open files and does not close them
+// Checks the delta against the carrier before anything is written: the carrier's size and the
+// fingerprint of its prefix must match. The encoded WAV is then a clone of the carrier (or the
+// carrier itself, at the same path) with the changed samples rewritten a block at a time.
+int whisper_engine::apply_delta(filesystem::path delta_path)
 {
-	uint32_t index = 0;
-	uint8_t data_byte = 0;
-	ios_base::iostate state = 0;
+	std::ifstream delta_file(delta_path, std::ios::binary);
+	delta_header header = { 0 };
+	std::vector<uint8_t> entries;
 
-	for (index = 0; !state && index < fixed_fields.data_byte_count; index++)
+	if (!delta_file.read((char*)&header, sizeof(header)) || memcmp(header.magic, delta_magic, sizeof(header.magic)))
 	{
-		state = decode_data_byte(data_byte);
-		if (state)
-			break;
-		datafile.write((const char*)(&data_byte), 1);
-		state = datafile.rdstate();
-		if (state)
+		*messages << "Not a whisper delta: " << delta_path.string() << endl;
+		throw whisper_error(whisper_unsupported_media);
+	}
+	if (header.mask_factor < 1 || header.mask_factor > max_mask_factor || header.prefix_bytes > header.carrier_bytes
+		|| header.sample_offset > header.prefix_bytes || (header.prefix_bytes - header.sample_offset) % sizeof(int16_t))
+	{
+		*messages << "Unsupported whisper delta: " << delta_path.string() << endl;
+		throw whisper_error(whisper_unsupported_media);
+	}
+	entries.assign(std::istreambuf_iterator<char>(delta_file), std::istreambuf_iterator<char>());
+
+	uint64_t prefix_samples = (header.prefix_bytes - header.sample_offset) / sizeof(int16_t);
+	uint64_t sample_index = 0;
+	uint64_t change_count = 0;
+	uint8_t change = 0;
+	for (delta_reader check(entries, header.mask_factor); check.read(sample_index, change) && sample_index < prefix_samples; )
+		change_count++;
+	if (change_count != header.change_count)
+	{
+		*messages << "Damaged whisper delta: " << delta_path.string() << endl;
+		throw whisper_error(whisper_unsupported_media);
+	}
+
+	uint64_t carrier_bytes = filesystem::file_size(infilepath);
+	if (carrier_bytes != header.carrier_bytes)
+	{
+		*messages << "The carrier has " << carrier_bytes << " bytes; the delta was made from one of " << header.carrier_bytes << endl;
+		return failed(whisper_carrier_mismatch);
+	}
+
+	if (!payload.allocate(io_block_bytes))
+	{
+		*messages << "Could not allocate I/O buffers" << endl;
+		return failed(whisper_out_of_memory);
+	}
+
+	uint64_t fingerprint = fingerprint_basis;
+	infile.open(infilepath, std::fstream::binary | std::fstream::in);
+	for (uint64_t remaining = header.prefix_bytes; remaining; )
+	{
+		size_t count = (size_t)min<uint64_t>(remaining, payload.size());
+		if (!infile.read(payload.data(), count))
 		{
-			cout << "ERROR writing output" << endl;
+			*messages << "Failed to read media input file: " << infilepath.string() << endl;
 			close_files();
-			exit(-1);
+			throw whisper_error(whisper_read_error);
 		}
+		fingerprint = fingerprint_bytes(fingerprint, payload.data(), count);
+		remaining -= count;
+	}
+	infile.close();
+
+	if (fingerprint != header.fingerprint)
+	{
+		*messages << "The delta was made from another carrier" << endl;
+		return failed(whisper_carrier_mismatch);
 	}
 
-	if (index < fixed_fields.data_byte_count)
+	std::error_code error;
+	bool in_place = filesystem::equivalent(infilepath, outfilepath, error);
+	if (!in_place && !clone_file(infilepath, outfilepath, io_block_bytes))
 	{
-		cout << "Unexpected EOF" << endl;
-		close_files();
-		exit(-1);
+		*messages << "Failed to clone the media input file to " << outfilepath.string() << endl;
+		throw whisper_error(whisper_file_error);
+	}
+	outfile.open(outfilepath, std::fstream::binary | std::fstream::in | std::fstream::out);
+
+	delta_reader reader(entries, header.mask_factor);
+	uint64_t block_begin = 0;
+	uint64_t block_end = 0;
+	bool ok = outfile.is_open();
+
+	for (uint64_t applied = 0; ok && applied < change_count && reader.read(sample_index, change); applied++)
+	{
+		uint64_t offset = header.sample_offset + sample_index * sizeof(int16_t);
+
+		if (offset >= block_end)
+		{
+			if (block_end)
+				ok = (bool)outfile.seekp((std::streamoff)block_begin).write(payload.data(), (std::streamsize)(block_end - block_begin));
+			block_begin = offset - offset % io_block_alignment;
+			block_end = min<uint64_t>(block_begin + payload.size(), header.prefix_bytes);
+			ok = ok && outfile.seekg((std::streamoff)block_begin).read(payload.data(), (std::streamsize)(block_end - block_begin));
+		}
+
+		int16_t* sample = (int16_t*)(payload.data() + (offset - block_begin));
+		*sample = apply_magnitude_xor(*sample, change);
 	}
+	if (ok && block_end)
+		ok = (bool)outfile.seekp((std::streamoff)block_begin).write(payload.data(), (std::streamsize)(block_end - block_begin));
+	ok = ok && outfile.flush();
+	outfile.close();
 
-	return state;
+	if (!ok)
+	{
+		*messages << "Failed to apply " << delta_path.string() << " to " << outfilepath.string() << endl;
+		return failed(whisper_write_error);
+	}
+	return 0;
 }
 
 template<typename SAMPLE_TYPE_T>
@@ -645,20 +1790,20 @@ bool whisper_engine::create_datafile(filesystem::path filepath)
 
 	if (filesystem::exists(filepath))
 	{
-		std::cout << "File already exists: " << filepath.string() << endl;
-		exit(-1);
+		*messages << "File already exists: " << filepath.string() << endl;
+		throw whisper_error(whisper_file_error);
 	}
 	if (filepath.filename().string().length() >= 1023)
 	{
-		cout << "Filename is too long: " << filepath.filename().string() << endl;
-		exit(-1);
+		*messages << "Filename is too long: " << filepath.filename().string() << endl;
+		throw whisper_error(whisper_invalid_argument);
 	}
 	outfile.open(filepath.string(), std::fstream::binary | std::fstream::out | std::fstream::trunc);
 
 	if (outfile.fail() || outfile.bad())
 	{
-		cout << "Unable to create datafile: " << filepath.filename().string() << endl;
-		exit(-1);
+		*messages << "Unable to create datafile: " << filepath.filename().string() << endl;
+		throw whisper_error(whisper_file_error);
 	}
 
 	filename = filepath.filename().string();
@@ -672,32 +1817,42 @@ bool whisper_engine::set_datafile_name(filesystem::path file_path, bool read_onl
 {
 	if (file_path.filename().string().length() >= 1023)
 	{
-		cout << "Filename is too long: " << file_path.filename().string() << endl;
-		exit(-1);
+		*messages << "Filename is too long: " << file_path.filename().string() << endl;
+		throw whisper_error(whisper_invalid_argument);
 	}
 	if (read_only)
 	{
 		if (!filesystem::exists(file_path))
 		{
-			cout << "Input datafile could not be found" << endl;
-			exit(-1);
+			*messages << "Input datafile could not be found" << endl;
+			throw whisper_error(whisper_file_error);
 		}
 		if (!filesystem::is_regular_file(file_path))
 		{
-			cout << "Input datafile is not a regular file" << endl;
-			exit(-1);
+			*messages << "Input datafile is not a regular file" << endl;
+			throw whisper_error(whisper_file_error);
 		}
 	}
 	else if (filesystem::exists(file_path))
 	{
 		if (!filesystem::is_directory(file_path))
 		{
-			cout << "A datafile already exists at that path. " << endl;
-			exit(-1);
+			*messages << "A datafile already exists at that path. " << endl;
+			throw whisper_error(whisper_file_error);
 		}
 	}
 	filename = "";  
 	datafilepath = file_path;
+	if (read_only)
+	{
+		in_datastream = nullptr;
+		in_dataspan = { 0 };
+	}
+	else
+	{
+		out_datastream = nullptr;
+		out_dataspan = { 0 };
+	}
 	return true;
 }
 
@@ -713,15 +1868,18 @@ bool whisper_engine::set_out_datapath(filesystem::path file_path)
 
 bool whisper_engine::set_out_datadir(filesystem::path file_path)
 {
-	if (!filesystem::exists(file_path) && !filesystem::create_directories(file_path))
+	std::error_code error;
+
+	// batch jobs may be creating the same parent directories at once
+	if (!filesystem::create_directories(file_path, error) && !filesystem::exists(file_path))
 	{
-		cout << "Output directory could not be found" << endl;
-		exit(-1);
+		*messages << "Output directory could not be found" << endl;
+		throw whisper_error(whisper_file_error);
 	}
 	if (!filesystem::is_directory(file_path))
 	{
-		cout << "Output filesystem object is not a directory" << endl;
-		exit(-1);
+		*messages << "Output filesystem object is not a directory" << endl;
+		throw whisper_error(whisper_file_error);
 	}
 	datafilepath = file_path;
 	return true;
@@ -731,29 +1889,188 @@ bool whisper_engine::set_in_musicpath(filesystem::path file_path)
 {
 	if (!filesystem::exists(file_path))
 	{
-		cout << "Input media file could not be found" << endl;
-		exit(-1);
+		*messages << "Input media file could not be found" << endl;
+		throw whisper_error(whisper_file_error);
 	}
 	if (!filesystem::is_regular_file(file_path))
 	{
-		cout << "Input media file is not a regular file" << endl;
-		exit(-1);
+		*messages << "Input media file is not a regular file" << endl;
+		throw whisper_error(whisper_file_error);
 	}
 	infilepath = file_path;
+	in_musicstream = nullptr;
+	in_musicspan = { 0 };
 	return true;
 }
 
 bool whisper_engine::set_out_musicpath(filesystem::path file_path)
 {
-	if (filesystem::exists(file_path))
+	bool in_place = selected_io_mode == io_patched && !infilepath.empty() && filesystem::exists(file_path)
+		&& filesystem::equivalent(infilepath, file_path);
+
+	if (filesystem::exists(file_path) && !in_place)
 	{
-		cout << "Output media file already exists at this path" << endl;
-		exit(-1);
+		*messages << "Output media file already exists at this path" << endl;
+		throw whisper_error(whisper_file_error);
 	}
 	outfilepath = file_path;
+	out_musicstream = nullptr;
+	out_musicspan = { 0 };
 	return true;
 }
 
+bool whisper_engine::set_in_musicstream(std::istream& stream)
+{
+	infilepath.clear();
+	in_musicspan = { 0 };
+	in_musicstream = &stream;
+	return true;
+}
+
+bool whisper_engine::set_out_musicstream(std::ostream& stream)
+{
+	outfilepath.clear();
+	out_musicspan = { 0 };
+	out_musicstream = &stream;
+	return true;
+}
+
+bool whisper_engine::set_in_datastream(std::istream& stream, const std::string& name)
+{
+	if (name.length() >= 1023 || name.length() < 1)
+	{
+		*messages << "Datafile name must have fewer than 1023 characters" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+
+	std::vector<char> block(min(io_block_bytes, max_spooled_bytes));
+	std::ostream* spool = &spooled_data;
+
+	remove_spool_file();
+	spooled_bytes = 0;
+	spooled_data.str("");
+	spooled_data.clear();
+	while (stream.read(block.data(), block.size()) || stream.gcount())
+	{
+		if (spool == &spooled_data && spooled_bytes + (uint64_t)stream.gcount() > max_spooled_bytes)
+		{
+			spool_path = filesystem::temp_directory_path() / ("whisper-" + to_string((uintptr_t)this) + "-" + to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".spool");
+			spool_file.open(spool_path, std::fstream::binary | std::fstream::in | std::fstream::out | std::fstream::trunc);
+			if (!spool_file.is_open() || !(spool_file << spooled_data.rdbuf()))
+			{
+				*messages << "Could not create a temporary file for the data stream: " << spool_path.string() << endl;
+				remove_spool_file();
+				throw whisper_error(whisper_file_error);
+			}
+			spooled_data.str("");
+			spool = &spool_file;
+		}
+		spool->write(block.data(), stream.gcount());
+		spooled_bytes += (uint64_t)stream.gcount();
+	}
+
+	if (stream.bad() || spool->fail())
+	{
+		*messages << "Could not read the data stream" << endl;
+		remove_spool_file();
+		throw whisper_error(whisper_read_error);
+	}
+
+	if (spool_file.is_open())
+		spool_file.seekg(0);
+	datafilepath.clear();
+	filename = name;
+	in_dataspan = { 0 };
+	in_datastream = spool_file.is_open() ? (std::istream*)&spool_file : &spooled_data;
+	return true;
+}
+
+void whisper_engine::remove_spool_file()
+{
+	if (spool_file.is_open())
+		spool_file.close();
+	if (!spool_path.empty())
+	{
+		std::error_code error;
+		filesystem::remove(spool_path, error);
+		spool_path.clear();
+	}
+	if (in_datastream == &spool_file)
+		in_datastream = nullptr;
+}
+
+bool whisper_engine::set_out_datastream(std::ostream& stream)
+{
+	datafilepath.clear();
+	out_dataspan = { 0 };
+	out_datastream = &stream;
+	return true;
+}
+
+bool whisper_engine::set_in_musicspan(const void* data, size_t bytes)
+{
+	if (!data)
+	{
+		*messages << "No media input given" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+	infilepath.clear();
+	in_musicstream = nullptr;
+	in_musicspan = { (char*)data, bytes };
+	return true;
+}
+
+bool whisper_engine::set_out_musicspan(void* data, size_t bytes)
+{
+	if (!data)
+	{
+		*messages << "No media output space given" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+	outfilepath.clear();
+	out_musicstream = nullptr;
+	out_musicspan = { (char*)data, bytes };
+	return true;
+}
+
+bool whisper_engine::set_in_dataspan(const void* data, size_t bytes, const std::string& name)
+{
+	if (name.length() >= 1023 || name.length() < 1)
+	{
+		*messages << "Datafile name must have fewer than 1023 characters" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+	if (!data && bytes)
+	{
+		*messages << "Data input span has no data" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+	datafilepath.clear();
+	filename = name;
+	in_datastream = nullptr;
+	in_dataspan = { (char*)(data ? data : ""), bytes };
+	return true;
+}
+
+bool whisper_engine::set_out_dataspan(void* data, size_t bytes)
+{
+	if (!data)
+	{
+		*messages << "No data output space given" << endl;
+		throw whisper_error(whisper_invalid_argument);
+	}
+	datafilepath.clear();
+	out_datastream = nullptr;
+	out_dataspan = { (char*)data, bytes };
+	return true;
+}
+
+size_t whisper_engine::encoded_size(size_t carrier_bytes)
+{
+	// every carrier byte outside the samples goes through unchanged, so the sizes match
+	return carrier_bytes;
+}
+
 uint8_t whisper_engine::data_mask_bit_count()
 {
 	uint8_t mask_factor = fixed_fields.attribits.mask_factor;
@@ -764,7 +2081,7 @@ uint8_t whisper_engine::data_mask_bit_count()
 
 int64_t whisper_engine::precision_mask()
 {
-	return (1i64 << (sample_bits() - 2)) - 1;
+	return ((int64_t)1 << (sample_bits() - 2)) - 1;
 }
 
 bool whisper_engine::magic_is_valid()
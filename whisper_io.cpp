@@ -0,0 +1,804 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_io.h"
+#include "whisper_async_io.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
+#endif
+#include <fstream>
+
+using namespace whisper;
+
+static size_t round_up(size_t bytes, size_t unit)
+{
+	return (bytes + unit - 1) / unit * unit;
+}
+
+pool_block buffer_pool::allocate_block(size_t bytes, bool huge_pages)
+{
+	pool_block block = { nullptr, bytes, false };
+
+#ifdef _WIN32
+	size_t large_page_bytes = huge_pages && bytes >= huge_page_bytes ? GetLargePageMinimum() : 0;
+	if (large_page_bytes)
+	{
+		// needs SeLockMemoryPrivilege; without it the heap will do
+		block.data = (char*)VirtualAlloc(nullptr, round_up(bytes, large_page_bytes), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		block.huge = block.data != nullptr;
+	}
+	if (!block.data)
+		block.data = (char*)_aligned_malloc(bytes, io_block_alignment);
+#else
+#ifdef __linux__
+	if (huge_pages && bytes >= huge_page_bytes)
+	{
+		// reserved huge pages if there are any, else transparent ones
+		size_t length = round_up(bytes, huge_page_bytes);
+		void* data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data == MAP_FAILED)
+		{
+			data = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (data != MAP_FAILED)
+				madvise(data, length, MADV_HUGEPAGE);
+		}
+		if (data != MAP_FAILED)
+		{
+			block.data = (char*)data;
+			block.huge = true;
+		}
+	}
+#endif
+	if (!block.data)
+		block.data = (char*)std::aligned_alloc(io_block_alignment, bytes);
+#endif
+	return block;
+}
+
+void buffer_pool::free_block(const pool_block& block)
+{
+	if (!block.data)
+		return;
+#ifdef _WIN32
+	if (block.huge)
+		VirtualFree(block.data, 0, MEM_RELEASE);
+	else
+		_aligned_free(block.data);
+#else
+#ifdef __linux__
+	if (block.huge)
+	{
+		munmap(block.data, round_up(block.size, huge_page_bytes));
+		return;
+	}
+#endif
+	std::free(block.data);
+#endif
+}
+
+buffer_pool::buffer_pool(size_t limit, bool huge_pages) : limit_bytes(limit), use_huge_pages(huge_pages), counters()
+{
+	free_blocks.reserve(max_pooled_blocks);		// giving a block back never allocates
+}
+
+buffer_pool::~buffer_pool()
+{
+	trim();
+}
+
+void buffer_pool::evict(size_t keep_bytes)
+{
+	size_t count = 0;
+	while (count < free_blocks.size() && counters.bytes_free > keep_bytes)
+	{
+		free_block(free_blocks[count]);
+		counters.bytes_free -= free_blocks[count].size;
+		counters.evictions++;
+		count++;
+	}
+	free_blocks.erase(free_blocks.begin(), free_blocks.begin() + count);
+}
+
+pool_block buffer_pool::acquire(size_t bytes)
+{
+	bool huge_pages;
+
+	bytes = round_up(bytes, io_block_alignment);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (size_t index = free_blocks.size(); index-- > 0;)
+		{
+			if (free_blocks[index].size == bytes)
+			{
+				pool_block block = free_blocks[index];
+				free_blocks.erase(free_blocks.begin() + index);
+				counters.hits++;
+				counters.bytes_free -= bytes;
+				counters.bytes_out += bytes;
+				return block;
+			}
+		}
+		counters.misses++;
+		huge_pages = use_huge_pages;
+	}
+
+	pool_block block = allocate_block(bytes, huge_pages);
+	if (block.data)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (block.huge)
+			counters.huge_blocks++;
+		counters.bytes_out += bytes;
+		counters.peak_bytes = std::max(counters.peak_bytes, counters.bytes_free + counters.bytes_out);
+	}
+	return block;
+}
+
+void buffer_pool::give_back(const pool_block& block)
+{
+	if (!block.data)
+		return;
+
+	std::lock_guard<std::mutex> guard(lock);
+	counters.bytes_out -= block.size;
+	if (block.size > limit_bytes)
+	{
+		free_block(block);
+		counters.evictions++;
+		return;
+	}
+	evict(limit_bytes - block.size);
+	if (free_blocks.size() == max_pooled_blocks)
+		evict(counters.bytes_free - free_blocks.front().size);
+	free_blocks.push_back(block);
+	counters.bytes_free += block.size;
+	counters.returns++;
+}
+
+void buffer_pool::trim()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	evict(0);
+}
+
+void buffer_pool::set_limit(size_t bytes)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	limit_bytes = bytes;
+	evict(bytes);
+}
+
+void buffer_pool::set_huge_pages(bool enabled)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	use_huge_pages = enabled;
+}
+
+pool_stats buffer_pool::stats() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+buffer_pool& whisper::shared_buffer_pool()
+{
+	static buffer_pool pool;
+	return pool;
+}
+
+void aligned_buffer::set_pool(buffer_pool* from)
+{
+	release();
+	pool = from;
+}
+
+bool aligned_buffer::allocate(size_t bytes)
+{
+	bytes = round_up(bytes, io_block_alignment);
+	if (bytes == block.size)
+		return true;
+	release();
+	block = pool ? pool->acquire(bytes) : buffer_pool::allocate_block(bytes, false);
+	if (!block.data)
+	{
+		block = pool_block();
+		return false;
+	}
+	return true;
+}
+
+void aligned_buffer::release()
+{
+	if (pool)
+		pool->give_back(block);
+	else
+		buffer_pool::free_block(block);
+	block = pool_block();
+}
+
+#ifdef _WIN32
+
+mapped_file::mapped_file() : base(nullptr), length(0), file_handle(INVALID_HANDLE_VALUE), mapping_handle(nullptr)
+{
+}
+
+bool mapped_file::map(bool writable)
+{
+	if (!length)
+		return true;	// nothing to map; data() stays null
+
+	mapping_handle = CreateFileMappingW(file_handle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY,
+		(DWORD)((uint64_t)length >> 32), (DWORD)length, nullptr);
+	if (!mapping_handle)
+		return false;
+
+	base = (char*)MapViewOfFile(mapping_handle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, length);
+	return base != nullptr;
+}
+
+bool mapped_file::open_read(const std::filesystem::path& file_path)
+{
+	close();
+	file_handle = CreateFileW(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file_handle, &file_size))
+		return false;
+	length = (size_t)file_size.QuadPart;
+
+	return map(false);
+}
+
+bool mapped_file::create(const std::filesystem::path& file_path, size_t size)
+{
+	close();
+	file_handle = CreateFileW(file_path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		return false;
+
+	length = size;
+	return map(true);
+}
+
+void mapped_file::close()
+{
+	if (base)
+		UnmapViewOfFile(base);
+	if (mapping_handle)
+		CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE)
+		CloseHandle(file_handle);
+	base = nullptr;
+	mapping_handle = nullptr;
+	file_handle = INVALID_HANDLE_VALUE;
+	length = 0;
+}
+
+#else
+
+mapped_file::mapped_file() : base(nullptr), length(0), fd(-1)
+{
+}
+
+bool mapped_file::map(bool writable)
+{
+	if (!length)
+		return true;	// nothing to map; data() stays null
+
+	void* address = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED)
+		return false;
+
+	base = (char*)address;
+	madvise(base, length, MADV_SEQUENTIAL);
+	return true;
+}
+
+bool mapped_file::open_read(const std::filesystem::path& file_path)
+{
+	close();
+	fd = ::open(file_path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat))
+		return false;
+	length = (size_t)file_stat.st_size;
+
+	return map(false);
+}
+
+bool mapped_file::create(const std::filesystem::path& file_path, size_t size)
+{
+	close();
+	fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	length = size;
+	if (ftruncate(fd, (off_t)size))
+		return false;
+#ifdef __linux__
+	// reserve the blocks now so that running out of space fails here rather than as SIGBUS mid-encode
+	if (size && posix_fallocate(fd, 0, (off_t)size))
+		return false;
+#endif
+	return map(true);
+}
+
+void mapped_file::close()
+{
+	if (base)
+		munmap(base, length);
+	if (fd >= 0)
+		::close(fd);
+	base = nullptr;
+	fd = -1;
+	length = 0;
+}
+
+#endif
+
+bool sample_source::attach(std::istream& stream, size_t block_bytes)
+{
+	block_bytes = std::clamp(block_bytes, min_io_block_bytes, max_io_block_bytes);
+	if (!buffer.allocate(block_bytes))
+		return false;
+	in = &stream;
+	reader = nullptr;
+	base = buffer.data();
+	head = 0;
+	tail = 0;
+	total = 0;
+	limit = UINT64_MAX;
+	unit = sizeof(int16_t);
+	at_eof = false;
+	read_calls = 0;
+	return true;
+}
+
+bool sample_source::attach(const char* data, size_t bytes)
+{
+	in = nullptr;
+	reader = nullptr;
+	base = data;
+	head = 0;
+	tail = data ? bytes : 0;
+	total = tail;
+	limit = UINT64_MAX;
+	unit = sizeof(int16_t);
+	at_eof = true;
+	read_calls = 0;
+	return true;
+}
+
+bool sample_source::attach(block_reader& blocks)
+{
+	in = nullptr;
+	reader = &blocks;
+	base = nullptr;
+	head = 0;
+	tail = 0;
+	total = 0;
+	limit = UINT64_MAX;
+	unit = sizeof(int16_t);
+	at_eof = false;
+	read_calls = 0;
+	return blocks.is_open();
+}
+
+void sample_source::detach()
+{
+	if (buffer.pooled())
+		buffer.release();
+	total -= tail - head;
+	in = nullptr;
+	reader = nullptr;
+	base = nullptr;
+	head = 0;
+	tail = 0;
+}
+
+bool sample_source::read_bytes(void* dst, size_t count)
+{
+	char* ptr = (char*)dst;
+	size_t buffered = std::min(count, tail - head);
+
+	if (buffered)
+		memcpy(ptr, base + head, buffered);
+	head += buffered;
+	count -= buffered;
+
+	if (!count)
+		return true;
+	if (reader)
+	{
+		while (count && !at_eof)
+		{
+			refill();
+			buffered = std::min(count, tail - head);
+			memcpy(ptr, base + head, buffered);
+			head += buffered;
+			ptr += buffered;
+			count -= buffered;
+		}
+		return !count;
+	}
+	if (!in || at_eof)
+		return false;
+
+	in->read(ptr + buffered, count);
+	read_calls++;
+	total += (uint64_t)in->gcount();
+	if ((size_t)in->gcount() < count)
+	{
+		at_eof = true;
+		return false;
+	}
+	return true;
+}
+
+bool sample_source::read_failed() const
+{
+	return reader && reader->failed();
+}
+
+void sample_source::refill()
+{
+	size_t partial = tail - head;	// less than a sample
+
+	if (reader)
+	{
+		size_t count = 0;
+		const char* block = reader->next(base + head, partial, count);
+		read_calls++;
+
+		if (!block || count == partial)
+		{
+			at_eof = true;
+			if (!block)
+				return;
+		}
+		base = block;
+		head = 0;
+		tail = count;
+		total += count - partial;
+		return;
+	}
+
+	memmove(buffer.data(), buffer.data() + head, partial);
+	head = 0;
+	tail = partial;
+
+	in->read(buffer.data() + tail, buffer.size() - tail);
+	read_calls++;
+	tail += (size_t)in->gcount();
+	total += (uint64_t)in->gcount();
+	if (!in->good())
+	{
+		at_eof = true;
+	}
+}
+
+size_t sample_source::fill()
+{
+	if (available() || (!in && !reader) || at_eof || limit - std::min(limit, position()) < unit)
+		return available();
+
+	refill();
+	return available();
+}
+
+size_t sample_source::fill_bytes()
+{
+	if (tail > head || (!in && !reader) || at_eof)
+		return tail - head;
+
+	refill();
+	return tail - head;
+}
+
+bool sample_sink::attach(std::ostream& stream, size_t block_bytes)
+{
+	block_bytes = std::clamp(block_bytes, min_io_block_bytes, max_io_block_bytes);
+	if (!buffer.allocate(block_bytes))
+		return false;
+	out = &stream;
+	writer = nullptr;
+	base = buffer.data();
+	capacity = buffer.size();
+	used = 0;
+	sent = 0;
+	write_calls = 0;
+	return true;
+}
+
+bool sample_sink::attach(char* data, size_t bytes)
+{
+	out = nullptr;
+	writer = nullptr;
+	base = data;
+	capacity = data ? bytes : 0;
+	used = 0;
+	sent = 0;
+	write_calls = 0;
+	return true;
+}
+
+bool sample_sink::attach(block_writer& blocks)
+{
+	out = nullptr;
+	writer = &blocks;
+	base = blocks.is_open() ? blocks.block() : nullptr;
+	capacity = blocks.is_open() ? blocks.size() : 0;
+	used = 0;
+	sent = 0;
+	write_calls = 0;
+	return base != nullptr;
+}
+
+void sample_sink::detach()
+{
+	if (out || writer)
+		flush();
+	if (buffer.pooled())
+		buffer.release();
+	sent += used;		// what is left was written in place
+	out = nullptr;
+	writer = nullptr;
+	base = nullptr;
+	capacity = 0;
+	used = 0;
+}
+
+char* sample_sink::reserve(size_t& count)
+{
+	if ((out || writer) && capacity - used < count && used)
+		send();
+	count = writer && writer->failed() ? 0 : std::min(count, capacity - used);
+	return base + used;
+}
+
+bool sample_sink::write(const void* data, size_t count)
+{
+	if (!base)
+		return false;
+
+	if (writer)
+	{
+		const char* bytes = (const char*)data;
+
+		while (count)
+		{
+			if (used == capacity && !send())
+				return false;
+			size_t part = std::min(count, capacity - used);
+			memcpy(base + used, bytes, part);
+			used += part;
+			bytes += part;
+			count -= part;
+		}
+		return !writer->failed();
+	}
+
+	if (used + count <= capacity)
+	{
+		memcpy(base + used, data, count);
+		used += count;
+		return true;
+	}
+
+	if (!out || !flush())
+		return false;
+
+	if (count >= capacity)
+	{
+		out->write((const char*)data, count);
+		sent += count;
+		write_calls++;
+		return out->good();
+	}
+
+	memcpy(base, data, count);
+	used = count;
+	return true;
+}
+
+bool sample_sink::send()
+{
+	if (!writer)
+		return flush();
+
+	bool submitted = writer->submit(used);
+	sent += used;
+	write_calls++;
+	base = writer->block();
+	used = 0;
+	return submitted;
+}
+
+bool sample_sink::flush()
+{
+	if (writer)
+		return send() && writer->drain();
+	if (!out)
+		return base != nullptr;
+	if (used)
+	{
+		out->write(base, used);
+		sent += used;
+		write_calls++;
+		used = 0;
+	}
+	return out->good();
+}
+
+#if defined(__linux__)
+
+bool whisper::copy_file_range_at(const std::filesystem::path& from, const std::filesystem::path& to,
+	uint64_t offset, uint64_t count, size_t block_bytes, uint64_t* io_calls)
+{
+	int in_fd = ::open(from.c_str(), O_RDONLY);
+	int out_fd = ::open(to.c_str(), O_WRONLY);
+	off_t in_offset = (off_t)offset;
+	off_t out_offset = (off_t)offset;
+	bool kernel_copy = true;
+	bool ok = in_fd >= 0 && out_fd >= 0;
+	uint64_t calls = 0;
+
+	// both ends sit at the same offset, so once it is aligned whole extents can be shared
+	uint64_t unaligned = std::min<uint64_t>(count, (io_block_alignment - offset % io_block_alignment) % io_block_alignment);
+
+	while (ok && kernel_copy && count)
+	{
+		size_t chunk = (size_t)std::min<uint64_t>(unaligned ? unaligned : count, 1 << 30);
+		ssize_t copied = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, chunk, 0);
+		calls++;
+		if (copied <= 0)
+		{
+			kernel_copy = false;	// not supported between these files (or at all); try the next way
+			break;
+		}
+		count -= (uint64_t)copied;
+		unaligned -= std::min<uint64_t>(unaligned, (uint64_t)copied);
+	}
+
+	kernel_copy = ok && count && lseek(out_fd, out_offset, SEEK_SET) == out_offset;
+	while (kernel_copy && count)
+	{
+		ssize_t copied = sendfile(out_fd, in_fd, &in_offset, (size_t)std::min<uint64_t>(count, 1 << 30));
+		calls++;
+		if (copied <= 0)
+			break;
+		out_offset += copied;
+		count -= (uint64_t)copied;
+	}
+
+	if (ok && count)
+	{
+		aligned_buffer buffer;
+		ok = buffer.allocate(std::clamp(block_bytes, min_io_block_bytes, max_io_block_bytes));
+		while (ok && count)
+		{
+			ssize_t length = pread(in_fd, buffer.data(), (size_t)std::min<uint64_t>(count, buffer.size()), in_offset);
+			calls += length > 0 ? 2 : 1;	// the write is only made after a read that got something
+			if (length <= 0 || pwrite(out_fd, buffer.data(), (size_t)length, out_offset) != length)
+			{
+				ok = false;
+				break;
+			}
+			in_offset += length;
+			out_offset += length;
+			count -= (uint64_t)length;
+		}
+	}
+
+	if (in_fd >= 0)
+		::close(in_fd);
+	if (out_fd >= 0 && ::close(out_fd))
+		ok = false;
+	if (io_calls)
+		*io_calls += calls;
+	return ok;
+}
+
+bool whisper::clone_file(const std::filesystem::path& from, const std::filesystem::path& to, size_t block_bytes)
+{
+	int in_fd = ::open(from.c_str(), O_RDONLY);
+	int out_fd = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+	bool cloned = in_fd >= 0 && out_fd >= 0 && !ioctl(out_fd, FICLONE, in_fd);
+	bool created = out_fd >= 0;
+
+	if (in_fd >= 0)
+		::close(in_fd);
+	if (out_fd >= 0 && ::close(out_fd))
+		return false;
+	if (cloned)
+		return true;
+
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(from, error);
+	return created && !error && copy_file_range_at(from, to, 0, size, block_bytes);
+}
+
+#else
+
+bool whisper::copy_file_range_at(const std::filesystem::path& from, const std::filesystem::path& to,
+	uint64_t offset, uint64_t count, size_t block_bytes, uint64_t* io_calls)
+{
+	std::ifstream in(from, std::ios::binary);
+	std::fstream out(to, std::ios::binary | std::ios::in | std::ios::out);
+	aligned_buffer buffer;
+	uint64_t calls = 0;
+
+	if (!in.seekg((std::streamoff)offset) || !out.seekp((std::streamoff)offset)
+		|| !buffer.allocate(std::clamp(block_bytes, min_io_block_bytes, max_io_block_bytes)))
+		return false;
+
+	while (count)
+	{
+		size_t length = (size_t)std::min<uint64_t>(count, buffer.size());
+		calls++;
+		if (!in.read(buffer.data(), length))
+			break;
+		calls++;
+		if (!out.write(buffer.data(), length))
+			break;
+		count -= length;
+	}
+	if (io_calls)
+		*io_calls += calls;
+	return !count && out.flush().good();
+}
+
+#ifdef _WIN32
+
+bool whisper::clone_file(const std::filesystem::path& from, const std::filesystem::path& to, size_t block_bytes)
+{
+	return CopyFileW(from.c_str(), to.c_str(), TRUE) != FALSE;	// clones blocks itself on ReFS and Dev Drive
+}
+
+#else
+
+bool whisper::clone_file(const std::filesystem::path& from, const std::filesystem::path& to, size_t block_bytes)
+{
+	std::error_code error;
+	uint64_t size = std::filesystem::file_size(from, error);
+
+	if (error || std::filesystem::exists(to) || !std::ofstream(to, std::ios::binary))
+		return false;
+	return copy_file_range_at(from, to, 0, size, block_bytes);
+}
+
+#endif
+
+#endif
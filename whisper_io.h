@@ -0,0 +1,243 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace whisper
+{
+	const size_t io_block_alignment = 4096;
+	const size_t default_io_block_bytes = 4 << 20;
+	const size_t min_io_block_bytes = 4 << 10;
+	const size_t max_io_block_bytes = 256 << 20;
+
+	enum io_mode
+	{
+		io_buffered,	// block-buffered fstreams
+		io_mapped,		// carrier (and encoded output) memory-mapped
+		io_patched,		// encoded output cloned from the carrier, or the carrier itself, and only the samples up to the last one changed rewritten
+		io_async		// like io_buffered, with reads kept in flight ahead of the kernels and writes behind them (see whisper_async_io.h)
+	};
+
+	class block_reader;
+	class block_writer;
+
+	typedef struct byte_span
+	{
+		char* data;
+		size_t size;
+	} byte_span;
+
+	const size_t huge_page_bytes = 2 << 20;
+	const size_t default_pool_bytes = 256 << 20;	// free blocks a buffer_pool keeps at most
+	const size_t max_pooled_blocks = 256;
+
+	typedef struct pool_block
+	{
+		char* data;
+		size_t size;
+		bool huge;			// mapped on huge pages rather than taken from the heap
+	} pool_block;
+
+	typedef struct pool_stats
+	{
+		uint64_t hits;			// blocks handed out from the free ones
+		uint64_t misses;		// blocks that had to be allocated
+		uint64_t returns;		// blocks given back and kept
+		uint64_t evictions;		// blocks freed to keep the pool under its limit
+		uint64_t huge_blocks;	// blocks allocated on huge pages
+		uint64_t bytes_free;	// held for reuse now
+		uint64_t bytes_out;		// handed out and not yet given back
+		uint64_t peak_bytes;	// most bytes_free + bytes_out at any one time
+	} pool_stats;
+
+	// Keeps the I/O blocks of finished jobs for the jobs after them, so that a batch or a service
+	// settles into reusing the same few blocks instead of allocating and faulting in new ones for
+	// each job. Blocks are matched by size, which is a whole number of io_block_alignment units;
+	// with huge pages on, blocks of huge_page_bytes and up are mapped on them where the system
+	// allows it. Safe to share between threads.
+	class buffer_pool
+	{
+	private:
+		mutable std::mutex lock;
+		std::vector<pool_block> free_blocks;	// most recently given back last
+		size_t limit_bytes;
+		bool use_huge_pages;
+		pool_stats counters;
+
+		void evict(size_t keep_bytes);
+	public:
+		buffer_pool(size_t limit = default_pool_bytes, bool huge_pages = false);
+		~buffer_pool();
+		buffer_pool(const buffer_pool&) = delete;
+		buffer_pool& operator=(const buffer_pool&) = delete;
+
+		pool_block acquire(size_t bytes);		// data is null if there is no memory for it
+		void give_back(const pool_block& block);
+		void trim();							// frees every block held
+		void set_limit(size_t bytes);
+		void set_huge_pages(bool enabled);
+		pool_stats stats() const;
+
+		static pool_block allocate_block(size_t bytes, bool huge_pages);
+		static void free_block(const pool_block& block);
+	};
+
+	// The pool batches and the in-process interface share.
+	buffer_pool& shared_buffer_pool();
+
+	class aligned_buffer
+	{
+	private:
+		pool_block block;
+		buffer_pool* pool;
+	public:
+		aligned_buffer() : block(), pool(nullptr) {}
+		~aligned_buffer() { release(); }
+		aligned_buffer(const aligned_buffer&) = delete;
+		aligned_buffer& operator=(const aligned_buffer&) = delete;
+
+		void set_pool(buffer_pool* from);	// releases the buffer; null goes back to the heap
+		bool pooled() const { return pool != nullptr; }
+		bool allocate(size_t bytes);  // contents are not preserved
+		void release();						// back to the pool, if there is one
+		char* data() { return block.data; }
+		size_t size() const { return block.size; }
+	};
+
+	class mapped_file
+	{
+	private:
+		char* base;
+		size_t length;
+#ifdef _WIN32
+		void* file_handle;
+		void* mapping_handle;
+#else
+		int fd;
+#endif
+		bool map(bool writable);
+	public:
+		mapped_file();
+		~mapped_file() { close(); }
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		bool open_read(const std::filesystem::path& file_path);
+		bool create(const std::filesystem::path& file_path, size_t size);	// preallocated, read-write
+		void close();
+		char* data() { return base; }
+		size_t size() const { return length; }
+	};
+
+	// Copies bytes [offset, offset + count) of from to the same offset in to, which must already
+	// hold at least offset bytes. Where the system can, the copy stays in the kernel and may share
+	// extents (copy_file_range, then sendfile); otherwise it goes through block_bytes blocks.
+	// Each copy, read and write call made is added to io_calls, if given.
+	bool copy_file_range_at(const std::filesystem::path& from, const std::filesystem::path& to,
+		uint64_t offset, uint64_t count, size_t block_bytes, uint64_t* io_calls = nullptr);
+
+	// Accepts and drops everything written to it.
+	class null_streambuf : public std::streambuf
+	{
+	protected:
+		int overflow(int c) override { return traits_type::not_eof(c); }
+		std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+	};
+
+	// Creates to with the contents of from, sharing its extents (a reflink) where the filesystem can.
+	bool clone_file(const std::filesystem::path& from, const std::filesystem::path& to, size_t block_bytes);
+
+	// Hands out carrier samples as spans, either from large blocks read off a stream or a
+	// block_reader, or directly from memory such as a mapped file.
+	class sample_source
+	{
+	private:
+		std::istream* in;
+		block_reader* reader;
+		aligned_buffer buffer;
+		const char* base;
+		size_t head;			// first unconsumed byte
+		size_t tail;			// one past the last valid byte
+		uint64_t total;			// bytes taken from the stream or span so far
+		uint64_t limit;			// offset past which no samples are handed out
+		size_t unit;			// bytes per sample
+		bool at_eof;
+		uint64_t read_calls;
+
+		void refill();
+	public:
+		sample_source() : in(nullptr), reader(nullptr), base(nullptr), head(0), tail(0), total(0), limit(UINT64_MAX), unit(sizeof(int16_t)), at_eof(false), read_calls(0) {}
+
+		bool attach(std::istream& stream, size_t block_bytes);
+		bool attach(const char* data, size_t bytes);
+		bool attach(block_reader& blocks);
+		void detach();								// a pooled buffer goes back to its pool; the position stays
+		void set_pool(buffer_pool* pool) { buffer.set_pool(pool); }
+
+		bool read_bytes(void* dst, size_t count);	// for headers; false on short read
+
+		size_t fill();								// samples available, refilling if the span is empty
+		size_t available() const { return (size_t)(std::min<uint64_t>(tail - head, limit - std::min(limit, position())) / unit); }
+		const int16_t* samples() const { return (const int16_t*)(base + head); }
+		const uint8_t* packed_samples() const { return (const uint8_t*)(base + head); }	// for samples other than 16-bit
+		void consume(size_t count) { head += count * unit; }
+		uint64_t position() const { return total - (tail - head); }	// offset of the next unconsumed byte
+		void set_limit(uint64_t offset) { limit = offset; }		// samples end at offset, such as the end of the data chunk
+		void set_sample_size(size_t bytes) { unit = bytes; }	// 2 by default; attach resets it
+		size_t sample_size() const { return unit; }
+		bool read_failed() const;
+		uint64_t reads() const { return read_calls; }	// stream reads or blocks taken since attach
+
+		// Bytes past the samples, which go through unchanged; the limit does not apply.
+		size_t fill_bytes();
+		const char* bytes() const { return base + head; }
+		void consume_bytes(size_t count) { head += count; }
+	};
+
+	// Collects output in large blocks written to a stream or handed to a block_writer, or directly
+	// into memory. Kernels write straight into the space handed out by reserve().
+	class sample_sink
+	{
+	private:
+		std::ostream* out;
+		block_writer* writer;
+		aligned_buffer buffer;
+		char* base;
+		size_t capacity;
+		size_t used;
+		uint64_t sent;			// bytes passed on, or filled in memory, before the current block
+		uint64_t write_calls;
+
+		bool send();								// passes the block on, without waiting for it to be written
+	public:
+		sample_sink() : out(nullptr), writer(nullptr), base(nullptr), capacity(0), used(0), sent(0), write_calls(0) {}
+
+		bool attach(std::ostream& stream, size_t block_bytes);
+		bool attach(char* data, size_t bytes);
+		bool attach(block_writer& blocks);
+		void detach();								// a pooled buffer goes back to its pool
+		void set_pool(buffer_pool* pool) { buffer.set_pool(pool); }
+
+		char* reserve(size_t& count);				// count is reduced to the space available
+		void commit(size_t count) { used += count; }
+		bool write(const void* data, size_t count);
+		bool flush();
+		uint64_t position() const { return sent + used; }	// bytes put out since attach; detach keeps it
+		uint64_t writes() const { return write_calls; }	// stream writes or blocks handed on since attach
+	};
+}
@@ -0,0 +1,1427 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_kernels.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define WHISPER_X86 1
+#include <immintrin.h>
+#if defined(__x86_64__) || defined(_M_X64)
+#define WHISPER_X64 1		// the multi-bit kernels need 64-bit pdep/pext
+#endif
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// MSVC allows intrinsics from any instruction set; GCC and Clang need them enabled per function.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define WHISPER_TARGET_AVX2
+#define WHISPER_TARGET_AVX512
+#else
+#define WHISPER_TARGET_AVX2 __attribute__((target("avx2,bmi,bmi2,popcnt")))
+#define WHISPER_TARGET_AVX512 __attribute__((target("avx512f,avx512bw,bmi,bmi2,popcnt")))
+#endif
+
+using namespace whisper;
+
+// |sample|, left negative for the most negative SAMPLE_BITS-bit value so that it is never
+// eligible, as abs() leaves the most negative 16-bit sample.
+template<typename SAMPLE_T, int SAMPLE_BITS>
+static inline SAMPLE_T magnitude(SAMPLE_T sample)
+{
+	if constexpr (sizeof(SAMPLE_T) < sizeof(int))
+		return abs(sample);
+	else
+	{
+		typedef typename std::make_unsigned<SAMPLE_T>::type unsigned_t;
+		if (SAMPLE_BITS < 8 * (int)sizeof(SAMPLE_T) && sample == -((SAMPLE_T)1 << (SAMPLE_BITS - 1)))
+			return -1;
+		return sample < 0 ? (SAMPLE_T)(0 - (unsigned_t)sample) : sample;
+	}
+}
+
+template<typename SAMPLE_T, int THRESHOLD_FACTOR, int MASK_FACTOR, int SAMPLE_BITS = 8 * sizeof(SAMPLE_T)>
+static size_t embed_span_scalar(const SAMPLE_T* in, SAMPLE_T* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR >= 1 && MASK_FACTOR <= THRESHOLD_FACTOR, "the payload bits must lie below the threshold");
+	const SAMPLE_T threshold = (SAMPLE_T)1 << THRESHOLD_FACTOR;
+	size_t index = 0;
+
+	while (index < count && bit_index < bit_count)
+	{
+		SAMPLE_T sample = in[index];
+		SAMPLE_T absamp = magnitude<SAMPLE_T, SAMPLE_BITS>(sample);
+		if (absamp >= threshold)
+		{
+			if (MASK_FACTOR == 1)
+			{
+				absamp &= ~1;
+				if (data[bit_index >> 3] & (1 << (bit_index & 7)))
+				{
+					absamp |= 1;
+				}
+				bit_index++;
+			}
+			else
+			{
+				// the final sample of a field may take fewer than MASK_FACTOR bits
+				uint32_t bits = (uint32_t)std::min<uint64_t>(MASK_FACTOR, bit_count - bit_index);
+				uint32_t field = data[bit_index >> 3] >> (bit_index & 7);
+				if ((bit_index & 7) + bits > 8)
+					field |= (uint32_t)data[(bit_index >> 3) + 1] << (8 - (bit_index & 7));
+				field &= (1u << bits) - 1;
+				absamp = (SAMPLE_T)((absamp & ~(SAMPLE_T)((1u << bits) - 1)) | field);
+				bit_index += bits;
+			}
+			sample = (sample >= 0) ? absamp : -absamp;
+		}
+		out[index++] = sample;
+	}
+	return index;
+}
+
+template<typename SAMPLE_T, int THRESHOLD_FACTOR, int MASK_FACTOR, int SAMPLE_BITS = 8 * sizeof(SAMPLE_T)>
+static size_t extract_span_scalar(const SAMPLE_T* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR >= 1 && MASK_FACTOR <= THRESHOLD_FACTOR, "the payload bits must lie below the threshold");
+	const SAMPLE_T threshold = (SAMPLE_T)1 << THRESHOLD_FACTOR;
+	size_t index = 0;
+
+	while (index < count && bit_index < bit_count)
+	{
+		SAMPLE_T absamp = magnitude<SAMPLE_T, SAMPLE_BITS>(in[index]);
+		if (absamp >= threshold)
+		{
+			if (MASK_FACTOR == 1)
+			{
+				if (absamp & 1)
+				{
+					data[bit_index >> 3] |= 1 << (bit_index & 7);
+				}
+				bit_index++;
+			}
+			else
+			{
+				uint32_t bits = (uint32_t)std::min<uint64_t>(MASK_FACTOR, bit_count - bit_index);
+				uint32_t field = (uint32_t)absamp & ((1u << bits) - 1);
+				data[bit_index >> 3] |= (uint8_t)(field << (bit_index & 7));
+				if ((bit_index & 7) + bits > 8)
+					data[(bit_index >> 3) + 1] |= (uint8_t)(field >> (8 - (bit_index & 7)));
+				bit_index += bits;
+			}
+		}
+		index++;
+	}
+	return index;
+}
+
+template<typename SAMPLE_T, int THRESHOLD_FACTOR, int SAMPLE_BITS = 8 * sizeof(SAMPLE_T)>
+static uint64_t count_eligible_scalar(const SAMPLE_T* in, size_t count)
+{
+	const SAMPLE_T threshold = (SAMPLE_T)1 << THRESHOLD_FACTOR;
+	uint64_t eligible = 0;
+
+	for (size_t index = 0; index < count; index++)
+	{
+		SAMPLE_T absamp = magnitude<SAMPLE_T, SAMPLE_BITS>(in[index]);
+		eligible += absamp >= threshold;
+	}
+	return eligible;
+}
+
+// Bits needed to write value: 32 less its leading zeros, and 0 for 0.
+static inline int bit_length(uint32_t value)
+{
+#ifdef _MSC_VER
+	unsigned long index = 0;
+	return _BitScanReverse(&index, value) ? (int)index + 1 : 0;
+#else
+	return value ? 32 - __builtin_clz(value) : 0;
+#endif
+}
+
+void whisper::magnitude_histogram_scalar(const int16_t* in, size_t count, uint64_t* at_least)
+{
+	uint64_t bit_lengths[magnitude_classes + 1] = { 0 };
+
+	for (size_t index = 0; index < count; index++)
+	{
+		int16_t absamp = abs(in[index]);
+		if (absamp < 0)
+			continue;	// the most negative sample is never eligible
+		bit_lengths[bit_length((uint32_t)absamp)]++;
+	}
+
+	// |sample| >= (1 << b) exactly when its bit length exceeds b
+	uint64_t total = 0;
+	for (int length = magnitude_classes; length > 0; length--)
+	{
+		total += bit_lengths[length];
+		at_least[length - 1] += total;
+	}
+}
+
+// Floating-point samples are sign and magnitude, so their bit patterns are worked on directly:
+// a sample is eligible when its magnitude is finite and at least 2^(THRESHOLD_FACTOR - 15), as
+// a 16-bit one is at 1 << THRESHOLD_FACTOR, and payload bits replace the lowest bits of its
+// mantissa. That leaves the exponent, and so whether the sample is eligible, as it was.
+template<typename RAW_T>
+struct float_layout
+{
+	static constexpr int mantissa_bits = sizeof(RAW_T) == 4 ? 23 : 52;
+	static constexpr RAW_T bias = sizeof(RAW_T) == 4 ? 127 : 1023;
+	static constexpr RAW_T sign = (RAW_T)1 << (8 * sizeof(RAW_T) - 1);
+	static constexpr RAW_T infinity = (2 * bias + 1) << mantissa_bits;
+
+	static constexpr RAW_T threshold(int threshold_factor) { return (bias + threshold_factor - 15) << mantissa_bits; }
+};
+
+// Bits [bit_index, bit_index + bits) of data, bits <= 8.
+static inline uint32_t payload_field(const uint8_t* data, uint64_t bit_index, uint32_t bits)
+{
+	uint32_t field = data[bit_index >> 3] >> (bit_index & 7);
+	if ((bit_index & 7) + bits > 8)
+		field |= (uint32_t)data[(bit_index >> 3) + 1] << (8 - (bit_index & 7));
+	return field & ((1u << bits) - 1);
+}
+
+static inline void store_payload_field(uint8_t* data, uint64_t bit_index, uint32_t bits, uint32_t field)
+{
+	data[bit_index >> 3] |= (uint8_t)(field << (bit_index & 7));
+	if ((bit_index & 7) + bits > 8)
+		data[(bit_index >> 3) + 1] |= (uint8_t)(field >> (8 - (bit_index & 7)));
+}
+
+template<typename SAMPLE_T, int THRESHOLD_FACTOR, int MASK_FACTOR>
+static size_t embed_float_scalar(const SAMPLE_T* in, SAMPLE_T* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR >= 1 && MASK_FACTOR <= THRESHOLD_FACTOR, "the payload bits must lie below the threshold");
+	typedef typename std::make_unsigned<SAMPLE_T>::type raw_t;
+	typedef float_layout<raw_t> layout;
+	const raw_t threshold = layout::threshold(THRESHOLD_FACTOR);
+	size_t index = 0;
+
+	while (index < count && bit_index < bit_count)
+	{
+		raw_t sample = (raw_t)in[index];
+		raw_t magnitude = sample & ~layout::sign;
+		if (magnitude >= threshold && magnitude < layout::infinity)
+		{
+			uint32_t bits = (uint32_t)std::min<uint64_t>(MASK_FACTOR, bit_count - bit_index);
+			sample = (sample & ~(raw_t)((1u << bits) - 1)) | payload_field(data, bit_index, bits);
+			bit_index += bits;
+		}
+		out[index++] = (SAMPLE_T)sample;
+	}
+	return index;
+}
+
+template<typename SAMPLE_T, int THRESHOLD_FACTOR, int MASK_FACTOR>
+static size_t extract_float_scalar(const SAMPLE_T* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR >= 1 && MASK_FACTOR <= THRESHOLD_FACTOR, "the payload bits must lie below the threshold");
+	typedef typename std::make_unsigned<SAMPLE_T>::type raw_t;
+	typedef float_layout<raw_t> layout;
+	const raw_t threshold = layout::threshold(THRESHOLD_FACTOR);
+	size_t index = 0;
+
+	while (index < count && bit_index < bit_count)
+	{
+		raw_t magnitude = (raw_t)in[index] & ~layout::sign;
+		if (magnitude >= threshold && magnitude < layout::infinity)
+		{
+			uint32_t bits = (uint32_t)std::min<uint64_t>(MASK_FACTOR, bit_count - bit_index);
+			store_payload_field(data, bit_index, bits, (uint32_t)magnitude & ((1u << bits) - 1));
+			bit_index += bits;
+		}
+		index++;
+	}
+	return index;
+}
+
+template<typename SAMPLE_T, int THRESHOLD_FACTOR>
+static uint64_t count_eligible_float_scalar(const SAMPLE_T* in, size_t count)
+{
+	typedef typename std::make_unsigned<SAMPLE_T>::type raw_t;
+	typedef float_layout<raw_t> layout;
+	const raw_t threshold = layout::threshold(THRESHOLD_FACTOR);
+	uint64_t eligible = 0;
+
+	for (size_t index = 0; index < count; index++)
+	{
+		raw_t magnitude = (raw_t)in[index] & ~layout::sign;
+		eligible += magnitude >= threshold && magnitude < layout::infinity;
+	}
+	return eligible;
+}
+
+// For floating-point samples, |sample| >= 2^(b - 15) exactly when its unbiased exponent is at least
+// b - 15; infinities, NaNs, zeros and subnormals are in no class.
+template<typename RAW_T>
+static int float_magnitude_length(RAW_T sample)
+{
+	typedef float_layout<RAW_T> layout;
+	RAW_T magnitude = sample & ~layout::sign;
+
+	if (magnitude >= layout::infinity || magnitude < ((RAW_T)1 << layout::mantissa_bits))
+		return 0;
+	int64_t exponent = (int64_t)(magnitude >> layout::mantissa_bits) - (int64_t)layout::bias;
+	return (int)std::clamp<int64_t>(exponent + 16, 0, wide_magnitude_classes);
+}
+
+void whisper::magnitude_histogram_wide(const void* in, size_t count, sample_format format, uint64_t* at_least)
+{
+	const uint32_t full_scale = 1u << (sample_format_bits(format) - 1);
+	const int32_t* in32 = (const int32_t*)in;
+	const uint64_t* in64 = (const uint64_t*)in;
+	uint64_t bit_lengths[wide_magnitude_classes + 1] = { 0 };
+
+	for (size_t index = 0; index < count; index++)
+	{
+		int length = 0;
+
+		if (format == sample_float32)
+			length = float_magnitude_length((uint32_t)in32[index]);
+		else if (format == sample_float64)
+			length = float_magnitude_length(in64[index]);
+		else
+		{
+			uint32_t absamp = in32[index] < 0 ? 0u - (uint32_t)in32[index] : (uint32_t)in32[index];
+			if (absamp >= full_scale)
+				continue;	// the most negative sample is never eligible
+			length = bit_length(absamp);
+		}
+		bit_lengths[length]++;
+	}
+
+	uint64_t total = 0;
+	for (int length = wide_magnitude_classes; length > 0; length--)
+	{
+		total += bit_lengths[length];
+		at_least[length - 1] += total;
+	}
+}
+
+static void unpack_24_scalar(const uint8_t* in, void* out_samples, size_t count)
+{
+	int32_t* out = (int32_t*)out_samples;
+
+	for (size_t index = 0; index < count; index++, in += 3)
+		out[index] = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 24) >> 8;
+}
+
+static void pack_24_scalar(const void* in_samples, uint8_t* out, size_t count)
+{
+	const int32_t* in = (const int32_t*)in_samples;
+
+	for (size_t index = 0; index < count; index++, out += 3)
+	{
+		out[0] = (uint8_t)in[index];
+		out[1] = (uint8_t)(in[index] >> 8);
+		out[2] = (uint8_t)(in[index] >> 16);
+	}
+}
+
+static void unpack_32(const uint8_t* in, void* out, size_t count)
+{
+	memcpy(out, in, count * sizeof(int32_t));
+}
+
+static void pack_32(const void* in, uint8_t* out, size_t count)
+{
+	memcpy(out, in, count * sizeof(int32_t));
+}
+
+static void unpack_64(const uint8_t* in, void* out, size_t count)
+{
+	memcpy(out, in, count * sizeof(int64_t));
+}
+
+static void pack_64(const void* in, uint8_t* out, size_t count)
+{
+	memcpy(out, in, count * sizeof(int64_t));
+}
+
+#ifdef WHISPER_X86
+
+// At least 56 payload bits starting at bit_index, without reading past the end of data.
+static inline uint64_t load_bits(const uint8_t* data, uint64_t bit_index, uint64_t bit_count)
+{
+	uint64_t offset = bit_index >> 3;
+	uint64_t byte_count = (bit_count + 7) >> 3;
+	uint64_t word = 0;
+
+	memcpy(&word, data + offset, (size_t)std::min<uint64_t>(sizeof(word), byte_count - offset));
+	return word >> (bit_index & 7);
+}
+
+// Blocks whose eligible samples would take the last payload bit are left to the scalar
+// kernel, so that the sample count returned stops exactly at the final bit.
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t embed_span_avx2(const int16_t* in, int16_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR == 1, "the multi-bit kernels are the *_fields_* ones");
+	const __m256i limit = _mm256_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m256i clear_lsb = _mm256_set1_epi16(~1);
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i lane_bits = _mm256_setr_epi16(0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+		0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, (int16_t)0x8000);
+	size_t index = 0;
+
+	while (index + 16 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		__m256i magnitude = _mm256_abs_epi16(samples);
+		__m256i eligible = _mm256_cmpgt_epi16(magnitude, limit);
+		uint32_t lane_mask = _pext_u32((uint32_t)_mm256_movemask_epi8(eligible), 0x55555555);
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		uint32_t lane_payload = _pdep_u32((uint32_t)load_bits(data, bit_index, bit_count), lane_mask);
+		__m256i payload = _mm256_and_si256(_mm256_set1_epi16((int16_t)lane_payload), lane_bits);
+		payload = _mm256_and_si256(_mm256_cmpeq_epi16(payload, lane_bits), one);
+
+		__m256i embedded = _mm256_or_si256(_mm256_and_si256(magnitude, clear_lsb), payload);
+		embedded = _mm256_sign_epi16(embedded, samples);
+		_mm256_storeu_si256((__m256i*)(out + index), _mm256_blendv_epi8(samples, embedded, eligible));
+
+		bit_index += needed;
+		index += 16;
+	}
+	return index + embed_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, out + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX512
+static size_t embed_span_avx512(const int16_t* in, int16_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR == 1, "the multi-bit kernels are the *_fields_* ones");
+	const __m512i limit = _mm512_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m512i clear_lsb = _mm512_set1_epi16(~1);
+	const __m512i one = _mm512_set1_epi16(1);
+	const __m512i zero = _mm512_setzero_si512();
+	size_t index = 0;
+
+	while (index + 32 <= count)
+	{
+		__m512i samples = _mm512_loadu_si512((const void*)(in + index));
+		__m512i magnitude = _mm512_abs_epi16(samples);
+		__mmask32 eligible = _mm512_cmpgt_epi16_mask(magnitude, limit);
+		uint32_t needed = (uint32_t)_mm_popcnt_u32((uint32_t)eligible);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		__mmask32 lane_payload = (__mmask32)_pdep_u32((uint32_t)load_bits(data, bit_index, bit_count), (uint32_t)eligible);
+		__m512i embedded = _mm512_or_si512(_mm512_and_si512(magnitude, clear_lsb), _mm512_maskz_mov_epi16(lane_payload, one));
+		embedded = _mm512_mask_sub_epi16(embedded, _mm512_movepi16_mask(samples), zero, embedded);
+		_mm512_storeu_si512((void*)(out + index), _mm512_mask_blend_epi16(eligible, samples, embedded));
+
+		bit_index += needed;
+		index += 32;
+	}
+	return index + embed_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, out + index, count - index, data, bit_index, bit_count);
+}
+
+// Appends payload bits to a zeroed output buffer, flushing whole bytes as they complete.
+class bit_writer
+{
+private:
+	uint8_t* data;
+	uint64_t byte_pos;
+	uint64_t pending;
+	uint32_t pending_bits;
+public:
+	bit_writer(uint8_t* data, uint64_t bit_index)
+		: data(data), byte_pos(bit_index >> 3), pending(data[bit_index >> 3]), pending_bits((uint32_t)(bit_index & 7))
+	{
+		pending &= (1u << pending_bits) - 1;
+	}
+
+	void append(uint32_t bits, uint32_t count)	// count <= 32
+	{
+		pending |= (uint64_t)bits << pending_bits;
+		pending_bits += count;
+		if (pending_bits >= 32)
+		{
+			uint32_t word = (uint32_t)pending;
+			memcpy(data + byte_pos, &word, sizeof(word));
+			byte_pos += 4;
+			pending >>= 32;
+			pending_bits -= 32;
+		}
+	}
+
+	void append_wide(uint64_t bits, uint32_t count)	// count <= 64
+	{
+		if (count > 32)
+		{
+			append((uint32_t)bits, 32);
+			bits >>= 32;
+			count -= 32;
+		}
+		append((uint32_t)bits, count);
+	}
+
+	void finish()
+	{
+		for (uint32_t bit = 0; bit < pending_bits; bit += 8)
+		{
+			data[byte_pos++] = (uint8_t)pending;
+			pending >>= 8;
+		}
+	}
+};
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t extract_span_avx2(const int16_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR == 1, "the multi-bit kernels are the *_fields_* ones");
+	if (bit_index >= bit_count)
+		return 0;
+
+	const __m256i limit = _mm256_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	bit_writer writer(data, bit_index);
+	size_t index = 0;
+
+	while (index + 16 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		__m256i eligible = _mm256_cmpgt_epi16(_mm256_abs_epi16(samples), limit);
+		uint32_t lane_mask = _pext_u32((uint32_t)_mm256_movemask_epi8(eligible), 0x55555555);
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		// the low bit of |sample| equals the low bit of sample; move it to the top of the low byte
+		uint32_t parity = _pext_u32((uint32_t)_mm256_movemask_epi8(_mm256_slli_epi16(samples, 7)), 0x55555555);
+		writer.append(_pext_u32(parity, lane_mask), needed);
+
+		bit_index += needed;
+		index += 16;
+	}
+	writer.finish();
+	return index + extract_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX512
+static size_t extract_span_avx512(const int16_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	static_assert(MASK_FACTOR == 1, "the multi-bit kernels are the *_fields_* ones");
+	if (bit_index >= bit_count)
+		return 0;
+
+	const __m512i limit = _mm512_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m512i one = _mm512_set1_epi16(1);
+	bit_writer writer(data, bit_index);
+	size_t index = 0;
+
+	while (index + 32 <= count)
+	{
+		__m512i samples = _mm512_loadu_si512((const void*)(in + index));
+		__mmask32 eligible = _mm512_cmpgt_epi16_mask(_mm512_abs_epi16(samples), limit);
+		uint32_t needed = (uint32_t)_mm_popcnt_u32((uint32_t)eligible);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		__mmask32 parity = _mm512_test_epi16_mask(samples, one);
+		writer.append(_pext_u32((uint32_t)parity, (uint32_t)eligible), needed);
+
+		bit_index += needed;
+		index += 32;
+	}
+	writer.finish();
+	return index + extract_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, count - index, data, bit_index, bit_count);
+}
+
+#ifdef WHISPER_X64
+
+// Multi-bit kernels: the MASK_FACTOR-bit fields of 16 lanes fill at most 64 bits, which pdep
+// and pext move between payload order and one byte per lane.
+
+// Payload bits starting at bit_index, 64 of them where data has that many.
+static inline uint64_t load_bits_wide(const uint8_t* data, uint64_t bit_index, uint64_t bit_count)
+{
+	uint64_t offset = bit_index >> 3;
+	uint64_t byte_count = (bit_count + 7) >> 3;
+	uint8_t bytes[9] = { 0 };
+	uint64_t word = 0;
+	uint32_t shift = (uint32_t)(bit_index & 7);
+
+	memcpy(bytes, data + offset, (size_t)std::min<uint64_t>(sizeof(bytes), byte_count - offset));
+	memcpy(&word, bytes, sizeof(word));
+	return shift ? (word >> shift) | ((uint64_t)bytes[8] << (64 - shift)) : word;
+}
+
+// Bit MASK_FACTOR * lane for each of 16 lanes.
+template<int MASK_FACTOR>
+static constexpr uint64_t field_starts()
+{
+	uint64_t starts = 0;
+	for (int lane = 0; lane < 16; lane++)
+		starts |= (uint64_t)1 << (lane * MASK_FACTOR);
+	return starts;
+}
+
+// The low MASK_FACTOR bits of each of 8 bytes.
+template<int MASK_FACTOR>
+static constexpr uint64_t byte_fields()
+{
+	return 0x0101010101010101ull * ((1u << MASK_FACTOR) - 1);
+}
+
+// Positions of the fields of the lanes set in lane_mask, packed MASK_FACTOR bits per lane.
+template<int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static inline uint64_t eligible_fields(uint32_t lane_mask)
+{
+	return _pdep_u64(lane_mask, field_starts<MASK_FACTOR>()) * ((1u << MASK_FACTOR) - 1);
+}
+
+// Deals the next payload fields out to the eligible lanes among 16, one byte per lane.
+template<int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static inline __m128i payload_field_bytes(uint64_t bits, uint32_t lane_mask)
+{
+	uint64_t fields = _pdep_u64(bits, eligible_fields<MASK_FACTOR>(lane_mask));
+	return _mm_set_epi64x((long long)_pdep_u64(fields >> (8 * MASK_FACTOR), byte_fields<MASK_FACTOR>()),
+		(long long)_pdep_u64(fields, byte_fields<MASK_FACTOR>()));
+}
+
+// The inverse: fields of the eligible lanes among 16, one byte per lane, in payload order.
+template<int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static inline uint64_t sample_field_bits(__m128i field_bytes, uint32_t lane_mask)
+{
+	uint64_t low = (uint64_t)_mm_cvtsi128_si64(field_bytes);
+	uint64_t high = (uint64_t)_mm_extract_epi64(field_bytes, 1);
+	uint64_t fields = _pext_u64(low, byte_fields<MASK_FACTOR>()) | (_pext_u64(high, byte_fields<MASK_FACTOR>()) << (8 * MASK_FACTOR));
+	return _pext_u64(fields, eligible_fields<MASK_FACTOR>(lane_mask));
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t embed_fields_avx2(const int16_t* in, int16_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	const __m256i limit = _mm256_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m256i clear_field = _mm256_set1_epi16((int16_t)~((1 << MASK_FACTOR) - 1));
+	size_t index = 0;
+
+	while (index + 16 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		__m256i magnitude = _mm256_abs_epi16(samples);
+		__m256i eligible = _mm256_cmpgt_epi16(magnitude, limit);
+		uint32_t lane_mask = _pext_u32((uint32_t)_mm256_movemask_epi8(eligible), 0x55555555);
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask) * MASK_FACTOR;
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		__m256i payload = _mm256_cvtepu8_epi16(payload_field_bytes<MASK_FACTOR>(load_bits_wide(data, bit_index, bit_count), lane_mask));
+		__m256i embedded = _mm256_or_si256(_mm256_and_si256(magnitude, clear_field), payload);
+		embedded = _mm256_sign_epi16(embedded, samples);
+		_mm256_storeu_si256((__m256i*)(out + index), _mm256_blendv_epi8(samples, embedded, eligible));
+
+		bit_index += needed;
+		index += 16;
+	}
+	return index + embed_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, out + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX512
+static size_t embed_fields_avx512(const int16_t* in, int16_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	const __m512i limit = _mm512_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m512i clear_field = _mm512_set1_epi16((int16_t)~((1 << MASK_FACTOR) - 1));
+	const __m512i zero = _mm512_setzero_si512();
+	size_t index = 0;
+
+	while (index + 32 <= count)
+	{
+		__m512i samples = _mm512_loadu_si512((const void*)(in + index));
+		__m512i magnitude = _mm512_abs_epi16(samples);
+		__mmask32 eligible = _mm512_cmpgt_epi16_mask(magnitude, limit);
+		uint32_t low_lanes = (uint32_t)eligible & 0xffff;
+		uint32_t low_needed = (uint32_t)_mm_popcnt_u32(low_lanes) * MASK_FACTOR;
+		uint32_t needed = (uint32_t)_mm_popcnt_u32((uint32_t)eligible) * MASK_FACTOR;
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		__m128i low = payload_field_bytes<MASK_FACTOR>(load_bits_wide(data, bit_index, bit_count), low_lanes);
+		__m128i high = payload_field_bytes<MASK_FACTOR>(load_bits_wide(data, bit_index + low_needed, bit_count), (uint32_t)eligible >> 16);
+		__m512i payload = _mm512_cvtepu8_epi16(_mm256_set_m128i(high, low));
+		__m512i embedded = _mm512_or_si512(_mm512_and_si512(magnitude, clear_field), payload);
+		embedded = _mm512_mask_sub_epi16(embedded, _mm512_movepi16_mask(samples), zero, embedded);
+		_mm512_storeu_si512((void*)(out + index), _mm512_mask_blend_epi16(eligible, samples, embedded));
+
+		bit_index += needed;
+		index += 32;
+	}
+	return index + embed_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, out + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t extract_fields_avx2(const int16_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	if (bit_index >= bit_count)
+		return 0;
+
+	const __m256i limit = _mm256_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m256i field_mask = _mm256_set1_epi16((1 << MASK_FACTOR) - 1);
+	bit_writer writer(data, bit_index);
+	size_t index = 0;
+
+	while (index + 16 <= count)
+	{
+		__m256i magnitude = _mm256_abs_epi16(_mm256_loadu_si256((const __m256i*)(in + index)));
+		__m256i eligible = _mm256_cmpgt_epi16(magnitude, limit);
+		uint32_t lane_mask = _pext_u32((uint32_t)_mm256_movemask_epi8(eligible), 0x55555555);
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask) * MASK_FACTOR;
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		__m256i fields = _mm256_and_si256(magnitude, field_mask);
+		__m128i field_bytes = _mm_packus_epi16(_mm256_castsi256_si128(fields), _mm256_extracti128_si256(fields, 1));
+		writer.append_wide(sample_field_bits<MASK_FACTOR>(field_bytes, lane_mask), needed);
+
+		bit_index += needed;
+		index += 16;
+	}
+	writer.finish();
+	return index + extract_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+WHISPER_TARGET_AVX512
+static size_t extract_fields_avx512(const int16_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	if (bit_index >= bit_count)
+		return 0;
+
+	const __m512i limit = _mm512_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	const __m512i field_mask = _mm512_set1_epi16((1 << MASK_FACTOR) - 1);
+	bit_writer writer(data, bit_index);
+	size_t index = 0;
+
+	while (index + 32 <= count)
+	{
+		__m512i magnitude = _mm512_abs_epi16(_mm512_loadu_si512((const void*)(in + index)));
+		__mmask32 eligible = _mm512_cmpgt_epi16_mask(magnitude, limit);
+		uint32_t low_lanes = (uint32_t)eligible & 0xffff;
+		uint32_t needed = (uint32_t)_mm_popcnt_u32((uint32_t)eligible) * MASK_FACTOR;
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		__m256i field_bytes = _mm512_maskz_cvtepi16_epi8(0xffffffff, _mm512_and_si512(magnitude, field_mask));
+		writer.append_wide(sample_field_bits<MASK_FACTOR>(_mm256_castsi256_si128(field_bytes), low_lanes),
+			(uint32_t)_mm_popcnt_u32(low_lanes) * MASK_FACTOR);
+		writer.append_wide(sample_field_bits<MASK_FACTOR>(_mm256_extracti128_si256(field_bytes, 1), (uint32_t)eligible >> 16),
+			(uint32_t)_mm_popcnt_u32((uint32_t)eligible >> 16) * MASK_FACTOR);
+
+		bit_index += needed;
+		index += 32;
+	}
+	writer.finish();
+	return index + extract_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>(in + index, count - index, data, bit_index, bit_count);
+}
+
+#endif
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static uint64_t count_eligible_avx2(const int16_t* in, size_t count)
+{
+	const __m256i limit = _mm256_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	uint64_t eligible_bytes = 0;
+	size_t index = 0;
+
+	for (; index + 16 <= count; index += 16)
+	{
+		__m256i magnitude = _mm256_abs_epi16(_mm256_loadu_si256((const __m256i*)(in + index)));
+		eligible_bytes += (uint64_t)_mm_popcnt_u32((uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi16(magnitude, limit)));
+	}
+	return eligible_bytes / 2 + count_eligible_scalar<int16_t, THRESHOLD_FACTOR>(in + index, count - index);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX512
+static uint64_t count_eligible_avx512(const int16_t* in, size_t count)
+{
+	const __m512i limit = _mm512_set1_epi16((1 << THRESHOLD_FACTOR) - 1);
+	uint64_t eligible = 0;
+	size_t index = 0;
+
+	for (; index + 32 <= count; index += 32)
+	{
+		__m512i magnitude = _mm512_abs_epi16(_mm512_loadu_si512((const void*)(in + index)));
+		eligible += (uint64_t)_mm_popcnt_u32((uint32_t)_mm512_cmpgt_epi16_mask(magnitude, limit));
+	}
+	return eligible + count_eligible_scalar<int16_t, THRESHOLD_FACTOR>(in + index, count - index);
+}
+
+// One compare per magnitude class, accumulated in 16-bit lanes that are
+// drained before they can overflow.
+WHISPER_TARGET_AVX2
+static void magnitude_histogram_avx2(const int16_t* in, size_t count, uint64_t* at_least)
+{
+	const size_t drain_interval = 32767 * 16;
+	const __m256i ones = _mm256_set1_epi16(1);
+	size_t index = 0;
+
+	while (index + 16 <= count)
+	{
+		__m256i classes[magnitude_classes - 1];
+		size_t block_end = std::min(count, index + drain_interval);
+
+		for (int b = 0; b < magnitude_classes - 1; b++)
+			classes[b] = _mm256_setzero_si256();
+
+		for (; index + 16 <= block_end; index += 16)
+		{
+			__m256i magnitude = _mm256_abs_epi16(_mm256_loadu_si256((const __m256i*)(in + index)));
+			for (int b = 0; b < magnitude_classes - 1; b++)
+			{
+				__m256i eligible = _mm256_cmpgt_epi16(magnitude, _mm256_set1_epi16((int16_t)((1 << b) - 1)));
+				classes[b] = _mm256_sub_epi16(classes[b], eligible);
+			}
+		}
+
+		for (int b = 0; b < magnitude_classes - 1; b++)
+		{
+			__m256i sums = _mm256_madd_epi16(classes[b], ones);
+			__m128i half = _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+			half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+			half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+			at_least[b] += (uint32_t)_mm_cvtsi128_si32(half);
+		}
+	}
+	magnitude_histogram_scalar(in + index, count - index, at_least);
+}
+
+WHISPER_TARGET_AVX512
+static void magnitude_histogram_avx512(const int16_t* in, size_t count, uint64_t* at_least)
+{
+	uint64_t classes[magnitude_classes - 1] = { 0 };
+	size_t index = 0;
+
+	for (; index + 32 <= count; index += 32)
+	{
+		__m512i magnitude = _mm512_abs_epi16(_mm512_loadu_si512((const void*)(in + index)));
+		for (int b = 0; b < magnitude_classes - 1; b++)
+		{
+			__mmask32 eligible = _mm512_cmpgt_epi16_mask(magnitude, _mm512_set1_epi16((int16_t)((1 << b) - 1)));
+			classes[b] += (uint64_t)_mm_popcnt_u32((uint32_t)eligible);
+		}
+	}
+	for (int b = 0; b < magnitude_classes - 1; b++)
+		at_least[b] += classes[b];
+	magnitude_histogram_scalar(in + index, count - index, at_least);
+}
+
+// Integer samples 32 to a step. Each magnitude is converted to float, whose exponent gives its bit
+// length once a conversion rounded up to the next power of two is taken back down; the lengths are
+// packed a byte each, in no particular order, and compared with each class, accumulated in 8-bit
+// lanes that are drained before they can overflow. Floating-point samples go to the scalar loop.
+WHISPER_TARGET_AVX2
+static __m256i wide_bit_lengths_avx2(const int32_t* in, __m256i top)
+{
+	const __m256i ones = _mm256_set1_epi32(1);
+
+	// the most negative sample is never eligible: it is past top, or for 32-bit samples its
+	// magnitude stays negative; either way it is given length 0, which no class takes
+	__m256i magnitude = _mm256_abs_epi32(_mm256_loadu_si256((const __m256i*)in));
+	__m256i invalid = _mm256_or_si256(_mm256_cmpgt_epi32(magnitude, top), _mm256_srai_epi32(magnitude, 31));
+	magnitude = _mm256_andnot_si256(invalid, magnitude);
+
+	__m256i exponent = _mm256_sub_epi32(_mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(magnitude)), 23), _mm256_set1_epi32(127));
+	__m256i power = _mm256_sllv_epi32(ones, exponent);	// 0 for the zeros, whose exponent is negative
+	__m256i reached = _mm256_cmpgt_epi32(magnitude, _mm256_sub_epi32(power, ones));
+	return _mm256_max_epi32(_mm256_sub_epi32(exponent, reached), _mm256_setzero_si256());
+}
+
+WHISPER_TARGET_AVX2
+static void magnitude_histogram_wide_avx2(const void* in, size_t count, sample_format format, uint64_t* at_least)
+{
+	if (sample_format_is_float(format))
+	{
+		magnitude_histogram_wide(in, count, format, at_least);
+		return;
+	}
+
+	const int32_t* in32 = (const int32_t*)in;
+	const int class_count = (int)sample_format_bits(format) - 1;	// |sample| < full scale
+	const __m256i top = _mm256_set1_epi32((int32_t)((1u << class_count) - 1));
+	const size_t drain_interval = 255 * 32;
+	size_t index = 0;
+
+	while (index + 32 <= count)
+	{
+		__m256i classes[wide_magnitude_classes - 1];
+		size_t block_end = std::min(count, index + drain_interval);
+
+		for (int b = 0; b < class_count; b++)
+			classes[b] = _mm256_setzero_si256();
+
+		for (; index + 32 <= block_end; index += 32)
+		{
+			__m256i low = _mm256_packus_epi32(wide_bit_lengths_avx2(in32 + index, top), wide_bit_lengths_avx2(in32 + index + 8, top));
+			__m256i high = _mm256_packus_epi32(wide_bit_lengths_avx2(in32 + index + 16, top), wide_bit_lengths_avx2(in32 + index + 24, top));
+			__m256i lengths = _mm256_packus_epi16(low, high);
+			for (int b = 0; b < class_count; b++)
+			{
+				__m256i eligible = _mm256_cmpgt_epi8(lengths, _mm256_set1_epi8((char)b));
+				classes[b] = _mm256_sub_epi8(classes[b], eligible);
+			}
+		}
+
+		for (int b = 0; b < class_count; b++)
+		{
+			// each sum of eight counts fits in the low 32 bits of its 64-bit lane
+			__m256i sums = _mm256_sad_epu8(classes[b], _mm256_setzero_si256());
+			__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+			half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+			at_least[b] += (uint32_t)_mm_cvtsi128_si32(half);
+		}
+	}
+	magnitude_histogram_wide(in32 + index, count - index, format, at_least);
+}
+
+// Eight samples per step: the 24 bytes are spread so that each 128-bit lane holds twelve, a
+// shuffle puts each sample's bytes at the top of a 32-bit lane, and an arithmetic shift brings
+// it down sign-extended. A step loads 32 bytes, so the last few samples are left to the scalar loop.
+WHISPER_TARGET_AVX2
+static void unpack_24_avx2(const uint8_t* in, void* out_samples, size_t count)
+{
+	int32_t* out = (int32_t*)out_samples;
+	const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	const __m256i place = _mm256_setr_epi8(
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+		-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+	size_t index = 0;
+
+	for (; index + 11 <= count; index += 8)
+	{
+		__m256i bytes = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(in + 3 * index)), spread);
+		_mm256_storeu_si256((__m256i*)(out + index), _mm256_srai_epi32(_mm256_shuffle_epi8(bytes, place), 8));
+	}
+	unpack_24_scalar(in + 3 * index, out + index, count - index);
+}
+
+// The reverse: the three low bytes of each sample are gathered to the front of each lane,
+// the two lanes' twelve bytes are joined, and 24 bytes are stored.
+WHISPER_TARGET_AVX2
+static void pack_24_avx2(const void* in_samples, uint8_t* out, size_t count)
+{
+	const int32_t* in = (const int32_t*)in_samples;
+	const __m256i gather = _mm256_setr_epi8(
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+		0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	size_t index = 0;
+
+	for (; index + 8 <= count; index += 8)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		__m256i bytes = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(samples, gather), join);
+		_mm_storeu_si128((__m128i*)(out + 3 * index), _mm256_castsi256_si128(bytes));
+		_mm_storel_epi64((__m128i*)(out + 3 * index + 16), _mm256_extracti128_si256(bytes, 1));
+	}
+	pack_24_scalar(in + index, out + 3 * index, count - index);
+}
+
+// One payload bit per eligible floating-point sample, eight 32-bit or four 64-bit samples per step.
+// The magnitude bits of a float order the same way as its magnitude, so eligibility is two
+// signed integer compares on the bit patterns with the sign cleared.
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static inline __m256i eligible_float32(__m256i samples)
+{
+	typedef float_layout<uint32_t> layout;
+	__m256i magnitude = _mm256_and_si256(samples, _mm256_set1_epi32((int32_t)~layout::sign));
+	__m256i above = _mm256_cmpgt_epi32(magnitude, _mm256_set1_epi32((int32_t)layout::threshold(THRESHOLD_FACTOR) - 1));
+	return _mm256_andnot_si256(_mm256_cmpgt_epi32(magnitude, _mm256_set1_epi32((int32_t)layout::infinity - 1)), above);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static inline __m256i eligible_float64(__m256i samples)
+{
+	typedef float_layout<uint64_t> layout;
+	__m256i magnitude = _mm256_and_si256(samples, _mm256_set1_epi64x((int64_t)~layout::sign));
+	__m256i above = _mm256_cmpgt_epi64(magnitude, _mm256_set1_epi64x((int64_t)layout::threshold(THRESHOLD_FACTOR) - 1));
+	return _mm256_andnot_si256(_mm256_cmpgt_epi64(magnitude, _mm256_set1_epi64x((int64_t)layout::infinity - 1)), above);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t embed_float32_avx2(const int32_t* in, int32_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	const __m256i clear_lsb = _mm256_set1_epi32(~1);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i lane_bits = _mm256_setr_epi32(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80);
+	size_t index = 0;
+
+	while (index + 8 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		__m256i eligible = eligible_float32<THRESHOLD_FACTOR>(samples);
+		uint32_t lane_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eligible));
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		uint32_t lane_payload = _pdep_u32((uint32_t)load_bits(data, bit_index, bit_count), lane_mask);
+		__m256i payload = _mm256_and_si256(_mm256_set1_epi32((int32_t)lane_payload), lane_bits);
+		payload = _mm256_and_si256(_mm256_cmpeq_epi32(payload, lane_bits), one);
+
+		__m256i embedded = _mm256_or_si256(_mm256_and_si256(samples, clear_lsb), payload);
+		_mm256_storeu_si256((__m256i*)(out + index), _mm256_blendv_epi8(samples, embedded, eligible));
+
+		bit_index += needed;
+		index += 8;
+	}
+	return index + embed_float_scalar<int32_t, THRESHOLD_FACTOR, 1>(in + index, out + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t embed_float64_avx2(const int64_t* in, int64_t* out, size_t count,
+	const uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	const __m256i clear_lsb = _mm256_set1_epi64x(~1ll);
+	const __m256i one = _mm256_set1_epi64x(1);
+	const __m256i lane_bits = _mm256_setr_epi64x(0x1, 0x2, 0x4, 0x8);
+	size_t index = 0;
+
+	while (index + 4 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		__m256i eligible = eligible_float64<THRESHOLD_FACTOR>(samples);
+		uint32_t lane_mask = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eligible));
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		uint32_t lane_payload = _pdep_u32((uint32_t)load_bits(data, bit_index, bit_count), lane_mask);
+		__m256i payload = _mm256_and_si256(_mm256_set1_epi64x(lane_payload), lane_bits);
+		payload = _mm256_and_si256(_mm256_cmpeq_epi64(payload, lane_bits), one);
+
+		__m256i embedded = _mm256_or_si256(_mm256_and_si256(samples, clear_lsb), payload);
+		_mm256_storeu_si256((__m256i*)(out + index), _mm256_blendv_epi8(samples, embedded, eligible));
+
+		bit_index += needed;
+		index += 4;
+	}
+	return index + embed_float_scalar<int64_t, THRESHOLD_FACTOR, 1>(in + index, out + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t extract_float32_avx2(const int32_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	if (bit_index >= bit_count)
+		return 0;
+
+	bit_writer writer(data, bit_index);
+	size_t index = 0;
+
+	while (index + 8 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		uint32_t lane_mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eligible_float32<THRESHOLD_FACTOR>(samples)));
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		uint32_t parity = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(samples, 31)));
+		writer.append(_pext_u32(parity, lane_mask), needed);
+
+		bit_index += needed;
+		index += 8;
+	}
+	writer.finish();
+	return index + extract_float_scalar<int32_t, THRESHOLD_FACTOR, 1>(in + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static size_t extract_float64_avx2(const int64_t* in, size_t count,
+	uint8_t* data, uint64_t& bit_index, uint64_t bit_count)
+{
+	if (bit_index >= bit_count)
+		return 0;
+
+	bit_writer writer(data, bit_index);
+	size_t index = 0;
+
+	while (index + 4 <= count)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		uint32_t lane_mask = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eligible_float64<THRESHOLD_FACTOR>(samples)));
+		uint32_t needed = (uint32_t)_mm_popcnt_u32(lane_mask);
+
+		if (needed >= bit_count - bit_index)
+			break;
+
+		uint32_t parity = (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_slli_epi64(samples, 63)));
+		writer.append(_pext_u32(parity, lane_mask), needed);
+
+		bit_index += needed;
+		index += 4;
+	}
+	writer.finish();
+	return index + extract_float_scalar<int64_t, THRESHOLD_FACTOR, 1>(in + index, count - index, data, bit_index, bit_count);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static uint64_t count_eligible_float32_avx2(const int32_t* in, size_t count)
+{
+	uint64_t eligible = 0;
+	size_t index = 0;
+
+	for (; index + 8 <= count; index += 8)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		eligible += (uint64_t)_mm_popcnt_u32((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eligible_float32<THRESHOLD_FACTOR>(samples))));
+	}
+	return eligible + count_eligible_float_scalar<int32_t, THRESHOLD_FACTOR>(in + index, count - index);
+}
+
+template<int THRESHOLD_FACTOR>
+WHISPER_TARGET_AVX2
+static uint64_t count_eligible_float64_avx2(const int64_t* in, size_t count)
+{
+	uint64_t eligible = 0;
+	size_t index = 0;
+
+	for (; index + 4 <= count; index += 4)
+	{
+		__m256i samples = _mm256_loadu_si256((const __m256i*)(in + index));
+		eligible += (uint64_t)_mm_popcnt_u32((uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eligible_float64<THRESHOLD_FACTOR>(samples))));
+	}
+	return eligible + count_eligible_float_scalar<int64_t, THRESHOLD_FACTOR>(in + index, count - index);
+}
+
+#endif
+
+simd_level whisper::detect_simd_level()
+{
+#if defined(WHISPER_X86) && defined(_MSC_VER) && !defined(__clang__)
+	int info[4] = { 0 };
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return simd_scalar;
+
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool popcnt = (info[2] & (1 << 23)) != 0;
+	if (!osxsave || !popcnt)
+		return simd_scalar;
+
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+	bool bmi2 = (info[1] & (1 << 8)) != 0;
+	bool avx512 = (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0 && (xcr0 & 0xe6) == 0xe6;
+
+	if (avx512 && avx2 && bmi2)
+		return simd_avx512;
+	if (avx2 && bmi2)
+		return simd_avx2;
+	return simd_scalar;
+#elif defined(WHISPER_X86)
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2") && __builtin_cpu_supports("popcnt");
+
+	if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return simd_avx512;
+	if (avx2)
+		return simd_avx2;
+	return simd_scalar;
+#else
+	return simd_scalar;
+#endif
+}
+
+const char* whisper::simd_level_name(simd_level level)
+{
+	switch (level)
+	{
+	case simd_avx2:
+		return "avx2";
+	case simd_avx512:
+		return "avx512";
+	default:
+		return "scalar";
+	}
+}
+
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+static kernel_set specialized_kernels(simd_level level)
+{
+#ifdef WHISPER_X86
+	if (MASK_FACTOR == 1 && level >= simd_avx512)
+		return { embed_span_avx512<THRESHOLD_FACTOR, 1>, extract_span_avx512<THRESHOLD_FACTOR, 1>,
+			count_eligible_avx512<THRESHOLD_FACTOR>, THRESHOLD_FACTOR, MASK_FACTOR, sample_int16 };
+	if (MASK_FACTOR == 1 && level >= simd_avx2)
+		return { embed_span_avx2<THRESHOLD_FACTOR, 1>, extract_span_avx2<THRESHOLD_FACTOR, 1>,
+			count_eligible_avx2<THRESHOLD_FACTOR>, THRESHOLD_FACTOR, MASK_FACTOR, sample_int16 };
+#endif
+#ifdef WHISPER_X64
+	if (level >= simd_avx512)
+		return { embed_fields_avx512<THRESHOLD_FACTOR, MASK_FACTOR>, extract_fields_avx512<THRESHOLD_FACTOR, MASK_FACTOR>,
+			count_eligible_avx512<THRESHOLD_FACTOR>, THRESHOLD_FACTOR, MASK_FACTOR, sample_int16 };
+	if (level >= simd_avx2)
+		return { embed_fields_avx2<THRESHOLD_FACTOR, MASK_FACTOR>, extract_fields_avx2<THRESHOLD_FACTOR, MASK_FACTOR>,
+			count_eligible_avx2<THRESHOLD_FACTOR>, THRESHOLD_FACTOR, MASK_FACTOR, sample_int16 };
+#endif
+	return { embed_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>, extract_span_scalar<int16_t, THRESHOLD_FACTOR, MASK_FACTOR>,
+		count_eligible_scalar<int16_t, THRESHOLD_FACTOR>, THRESHOLD_FACTOR, MASK_FACTOR, sample_int16 };
+}
+
+// 24- and 32-bit samples have scalar kernels only; most of their time goes to unpacking and
+// packing, which is vectorized. Floating-point samples have AVX2 kernels for one bit per sample.
+template<sample_format FORMAT, int THRESHOLD_FACTOR, int MASK_FACTOR>
+static kernel_set specialized_wide_kernels(simd_level level)
+{
+	kernel_set kernels = { nullptr, nullptr, nullptr, THRESHOLD_FACTOR, MASK_FACTOR, FORMAT };
+
+	if constexpr (FORMAT == sample_float32)
+	{
+		kernels.embed_wide = embed_float_scalar<int32_t, THRESHOLD_FACTOR, MASK_FACTOR>;
+		kernels.extract_wide = extract_float_scalar<int32_t, THRESHOLD_FACTOR, MASK_FACTOR>;
+		kernels.count_wide = count_eligible_float_scalar<int32_t, THRESHOLD_FACTOR>;
+#ifdef WHISPER_X86
+		if (level >= simd_avx2)
+		{
+			if (MASK_FACTOR == 1)
+			{
+				kernels.embed_wide = embed_float32_avx2<THRESHOLD_FACTOR>;
+				kernels.extract_wide = extract_float32_avx2<THRESHOLD_FACTOR>;
+			}
+			kernels.count_wide = count_eligible_float32_avx2<THRESHOLD_FACTOR>;
+		}
+#endif
+	}
+	else if constexpr (FORMAT == sample_float64)
+	{
+		kernels.embed_wide64 = embed_float_scalar<int64_t, THRESHOLD_FACTOR, MASK_FACTOR>;
+		kernels.extract_wide64 = extract_float_scalar<int64_t, THRESHOLD_FACTOR, MASK_FACTOR>;
+		kernels.count_wide64 = count_eligible_float_scalar<int64_t, THRESHOLD_FACTOR>;
+#ifdef WHISPER_X86
+		if (level >= simd_avx2)
+		{
+			if (MASK_FACTOR == 1)
+			{
+				kernels.embed_wide64 = embed_float64_avx2<THRESHOLD_FACTOR>;
+				kernels.extract_wide64 = extract_float64_avx2<THRESHOLD_FACTOR>;
+			}
+			kernels.count_wide64 = count_eligible_float64_avx2<THRESHOLD_FACTOR>;
+		}
+#endif
+	}
+	else
+	{
+		constexpr int sample_bits = FORMAT == sample_int24 ? 24 : 32;
+
+		kernels.embed_wide = embed_span_scalar<int32_t, THRESHOLD_FACTOR, MASK_FACTOR, sample_bits>;
+		kernels.extract_wide = extract_span_scalar<int32_t, THRESHOLD_FACTOR, MASK_FACTOR, sample_bits>;
+		kernels.count_wide = count_eligible_scalar<int32_t, THRESHOLD_FACTOR, sample_bits>;
+	}
+	(void)level;
+	return kernels;
+}
+
+typedef kernel_set (*kernel_set_factory)(simd_level level);
+
+// One entry per threshold factor, from min_threshold_factor up; mask factors above a
+// threshold factor would let embedding drop a sample below the threshold, so those are null.
+template<int THRESHOLD_FACTOR, int MASK_FACTOR>
+static constexpr kernel_set_factory table_entry()
+{
+	if constexpr (MASK_FACTOR <= THRESHOLD_FACTOR)
+		return specialized_kernels<THRESHOLD_FACTOR, MASK_FACTOR>;
+	else
+		return nullptr;
+}
+
+// Integer formats take threshold factors up to sample_bits - 3, floating-point ones up to
+// max_threshold_factor; the tables run to the widest.
+template<sample_format FORMAT>
+static constexpr int max_wide_threshold_factor()
+{
+	return FORMAT == sample_int24 ? 21 : FORMAT == sample_int32 ? 29 : (int)max_threshold_factor;
+}
+
+template<sample_format FORMAT, int THRESHOLD_FACTOR, int MASK_FACTOR>
+static constexpr kernel_set_factory wide_table_entry()
+{
+	if constexpr (MASK_FACTOR <= THRESHOLD_FACTOR && THRESHOLD_FACTOR <= max_wide_threshold_factor<FORMAT>())
+		return specialized_wide_kernels<FORMAT, THRESHOLD_FACTOR, MASK_FACTOR>;
+	else
+		return nullptr;
+}
+
+template<int MASK_FACTOR, size_t... FACTOR_OFFSETS>
+static const kernel_set_factory* threshold_table(std::index_sequence<FACTOR_OFFSETS...>)
+{
+	static const kernel_set_factory table[] = { table_entry<(int)(min_threshold_factor + FACTOR_OFFSETS), MASK_FACTOR>()... };
+	return table;
+}
+
+template<sample_format FORMAT, int MASK_FACTOR, size_t... FACTOR_OFFSETS>
+static const kernel_set_factory* wide_threshold_table(std::index_sequence<FACTOR_OFFSETS...>)
+{
+	static const kernel_set_factory table[] = { wide_table_entry<FORMAT, (int)(min_threshold_factor + FACTOR_OFFSETS), MASK_FACTOR>()... };
+	return table;
+}
+
+template<sample_format FORMAT>
+static const kernel_set_factory* wide_mask_table(uint32_t mask_factor)
+{
+	auto factors = std::make_index_sequence<max_wide_threshold_factor<FORMAT>() - min_threshold_factor + 1>();
+
+	switch (mask_factor)
+	{
+	case 1: return wide_threshold_table<FORMAT, 1>(factors);
+	case 2: return wide_threshold_table<FORMAT, 2>(factors);
+	case 3: return wide_threshold_table<FORMAT, 3>(factors);
+	case 4: return wide_threshold_table<FORMAT, 4>(factors);
+	default: return nullptr;
+	}
+}
+
+bool whisper::select_kernels(simd_level level, uint32_t threshold_factor, uint32_t mask_factor, kernel_set& kernels, sample_format format)
+{
+	auto factors = std::make_index_sequence<max_threshold_factor - min_threshold_factor + 1>();
+	uint32_t max_factor = sample_format_is_float(format) ? max_threshold_factor : sample_format_bits(format) - 3;
+
+	if (threshold_factor < min_threshold_factor || threshold_factor > max_factor)
+		return false;
+
+	const kernel_set_factory* table = nullptr;
+
+	if (format != sample_int16)
+	{
+		switch (format)
+		{
+		case sample_int24: table = wide_mask_table<sample_int24>(mask_factor); break;
+		case sample_int32: table = wide_mask_table<sample_int32>(mask_factor); break;
+		case sample_float32: table = wide_mask_table<sample_float32>(mask_factor); break;
+		case sample_float64: table = wide_mask_table<sample_float64>(mask_factor); break;
+		default: break;
+		}
+		if (!table)
+			return false;
+	}
+	else switch (mask_factor)
+	{
+	case 1: table = threshold_table<1>(factors); break;
+	case 2: table = threshold_table<2>(factors); break;
+	case 3: table = threshold_table<3>(factors); break;
+	case 4: table = threshold_table<4>(factors); break;
+	default: return false;
+	}
+
+	kernel_set_factory factory = table[threshold_factor - min_threshold_factor];
+	if (!factory)
+		return false;
+	kernels = factory(level);
+	return true;
+}
+
+wide_histogram_kernel whisper::select_wide_histogram_kernel(simd_level level)
+{
+#ifdef WHISPER_X86
+	if (level >= simd_avx2)
+		return magnitude_histogram_wide_avx2;
+#endif
+	return magnitude_histogram_wide;
+}
+
+histogram_kernel whisper::select_histogram_kernel(simd_level level)
+{
+#ifdef WHISPER_X86
+	if (level >= simd_avx512)
+		return magnitude_histogram_avx512;
+	if (level >= simd_avx2)
+		return magnitude_histogram_avx2;
+#endif
+	return magnitude_histogram_scalar;
+}
+
+bool whisper::select_converters(simd_level level, sample_format format, unpack_kernel& unpack, pack_kernel& pack)
+{
+	switch (format)
+	{
+	case sample_int24:
+#ifdef WHISPER_X86
+		if (level >= simd_avx2)
+		{
+			unpack = unpack_24_avx2;
+			pack = pack_24_avx2;
+			return true;
+		}
+#endif
+		unpack = unpack_24_scalar;
+		pack = pack_24_scalar;
+		return true;
+	case sample_int32:
+	case sample_float32:
+		unpack = unpack_32;
+		pack = pack_32;
+		return true;
+	case sample_float64:
+		unpack = unpack_64;
+		pack = pack_64;
+		return true;
+	default:
+		return false;
+	}
+}
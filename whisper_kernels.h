@@ -0,0 +1,135 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace whisper
+{
+	enum simd_level
+	{
+		simd_scalar,
+		simd_avx2,		// AVX2 + BMI2, 16 samples per step
+		simd_avx512		// AVX-512BW + BMI2, 32 samples per step
+	};
+
+	// Kernels are specialized at compile time for a sample type, a threshold of 1 << threshold_factor
+	// and mask_factor payload bits per eligible sample (|sample| >= threshold), following attribit_fields.
+
+	// Embeds bits [bit_index, bit_count) of data, least significant bit of each byte first, into the
+	// eligible samples of in, writing the result to out, which may alias in.
+	// Returns the number of samples consumed; the last one consumed carries the final bit.
+	typedef size_t (*embed_kernel)(const int16_t* in, int16_t* out, size_t count,
+		const uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+
+	// Collects bits [bit_index, bit_count) from the eligible samples of in into data, which must be
+	// zeroed beforehand. Returns the number of samples consumed.
+	typedef size_t (*extract_kernel)(const int16_t* in, size_t count,
+		uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+
+	// Number of eligible samples in in.
+	typedef uint64_t (*count_kernel)(const int16_t* in, size_t count);
+
+	// How carrier samples are stored. 24- and 32-bit integer samples are worked on sign-extended to
+	// 32 bits; floating-point samples as their bit patterns, which are sign and magnitude.
+	enum sample_format
+	{
+		sample_int16,
+		sample_int24,
+		sample_int32,
+		sample_float32,
+		sample_float64
+	};
+
+	inline uint32_t sample_format_bits(sample_format format)
+	{
+		static const uint32_t bits[] = { 16, 24, 32, 32, 64 };
+		return bits[format];
+	}
+
+	inline bool sample_format_is_float(sample_format format) { return format >= sample_float32; }
+
+	// The same as the kernels above for the other formats, on 32-bit samples or, for 64-bit
+	// floating point, on 64-bit ones.
+	typedef size_t (*wide_embed_kernel)(const int32_t* in, int32_t* out, size_t count,
+		const uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+	typedef size_t (*wide_extract_kernel)(const int32_t* in, size_t count,
+		uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+	typedef uint64_t (*wide_count_kernel)(const int32_t* in, size_t count);
+	typedef size_t (*wide64_embed_kernel)(const int64_t* in, int64_t* out, size_t count,
+		const uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+	typedef size_t (*wide64_extract_kernel)(const int64_t* in, size_t count,
+		uint8_t* data, uint64_t& bit_index, uint64_t bit_count);
+	typedef uint64_t (*wide64_count_kernel)(const int64_t* in, size_t count);
+
+	// Only the kernels for format are set.
+	typedef struct kernel_set
+	{
+		embed_kernel embed;
+		extract_kernel extract;
+		count_kernel count;
+		uint32_t threshold_factor;
+		uint32_t payload_bits;		// per eligible sample
+		sample_format format;
+		wide_embed_kernel embed_wide;
+		wide_extract_kernel extract_wide;
+		wide_count_kernel count_wide;
+		wide64_embed_kernel embed_wide64;
+		wide64_extract_kernel extract_wide64;
+		wide64_count_kernel count_wide64;
+	} kernel_set;
+
+	const uint32_t min_threshold_factor = 1;
+	const uint32_t max_threshold_factor = 13;	// 1 << (sample_bits - 3), for 16-bit samples
+	const uint32_t default_threshold_factor = 11;	// 0x800, always used for the whisper metadata
+	const uint32_t max_mask_factor = 4;
+
+	// Threshold factors are given for 16-bit samples, and keep the threshold at the same fraction
+	// of full scale in other formats: for wider integer samples they move up with the sample size,
+	// and floating-point samples, whose full scale is 1.0, keep them with a threshold of
+	// 2^(threshold_factor - 15).
+	inline uint32_t threshold_factor_for(sample_format format, uint32_t threshold_factor)
+	{
+		return sample_format_is_float(format) ? threshold_factor : threshold_factor + sample_format_bits(format) - 16;
+	}
+
+	// Adds to at_least[b] the number of samples in in with |sample| >= (1 << b), for b < magnitude_classes.
+	const int magnitude_classes = 16;
+	typedef void (*histogram_kernel)(const int16_t* in, size_t count, uint64_t* at_least);
+
+	void magnitude_histogram_scalar(const int16_t* in, size_t count, uint64_t* at_least);
+
+	// Likewise for the other formats, samples held as the wide kernels take them, for b below
+	// wide_magnitude_classes and thresholds as threshold_factor_for gives them.
+	const int wide_magnitude_classes = 32;
+	typedef void (*wide_histogram_kernel)(const void* in, size_t count, sample_format format, uint64_t* at_least);
+
+	void magnitude_histogram_wide(const void* in, size_t count, sample_format format, uint64_t* at_least);
+
+	// Packed little-endian samples to and from the form the wide kernels take: 24-bit samples are
+	// sign-extended on the way in and cut back to their three low bytes on the way out.
+	typedef void (*unpack_kernel)(const uint8_t* in, void* out, size_t count);
+	typedef void (*pack_kernel)(const void* in, uint8_t* out, size_t count);
+
+	simd_level detect_simd_level();
+	const char* simd_level_name(simd_level level);
+
+	// Looks up the kernels for samples in format; false if there are none for the combination, which
+	// includes mask factors above the threshold factor and threshold factors above sample_bits - 3
+	// for integer samples or max_threshold_factor for floating-point ones. With several bits per
+	// sample, the last sample to carry a bit stream may carry fewer, leaving its remaining low bits
+	// as they were.
+	bool select_kernels(simd_level level, uint32_t threshold_factor, uint32_t mask_factor, kernel_set& kernels, sample_format format = sample_int16);
+	histogram_kernel select_histogram_kernel(simd_level level);
+	wide_histogram_kernel select_wide_histogram_kernel(simd_level level);
+	bool select_converters(simd_level level, sample_format format, unpack_kernel& unpack, pack_kernel& pack);
+}
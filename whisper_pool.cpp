@@ -0,0 +1,85 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_pool.h"
+
+using namespace whisper;
+
+engine_pool::engine_pool(buffer_pool* buffers, size_t limit) : limit(limit), buffers(buffers), counters()
+{
+	idle.reserve(limit);
+}
+
+std::unique_ptr<whisper_engine> engine_pool::acquire()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!idle.empty())
+		{
+			std::unique_ptr<whisper_engine> engine = std::move(idle.back());
+			idle.pop_back();
+			counters.hits++;
+			counters.idle = idle.size();
+			return engine;
+		}
+		counters.misses++;
+	}
+
+	std::unique_ptr<whisper_engine> engine = std::make_unique<whisper_engine>();
+	engine->set_buffer_pool(buffers);
+	return engine;
+}
+
+void engine_pool::give_back(std::unique_ptr<whisper_engine> engine)
+{
+	if (!engine)
+		return;
+
+	engine->reset();
+	engine->set_message_stream(cout);	// the job's stream is likely gone
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (idle.size() >= limit)
+	{
+		counters.discards++;
+		return;		// the engine is freed once the lock is released
+	}
+	idle.push_back(std::move(engine));
+	counters.returns++;
+	counters.idle = idle.size();
+}
+
+void engine_pool::set_limit(size_t engines)
+{
+	std::vector<std::unique_ptr<whisper_engine>> excess;
+	std::lock_guard<std::mutex> guard(lock);
+
+	limit = engines;
+	while (idle.size() > limit)
+	{
+		excess.push_back(std::move(idle.front()));
+		idle.erase(idle.begin());
+	}
+	counters.idle = idle.size();
+}
+
+engine_pool_stats engine_pool::stats()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return counters;
+}
+
+engine_pool& whisper::shared_engine_pool()
+{
+	// the buffer pool comes first, so that it outlives the engines handing blocks back to it
+	static buffer_pool& buffers = shared_buffer_pool();
+	static engine_pool engines(&buffers);
+	return engines;
+}
@@ -0,0 +1,72 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include "whisper.h"
+
+#include <memory>
+#include <mutex>
+
+namespace whisper
+{
+	const size_t default_idle_engines = 16;
+
+	typedef struct engine_pool_stats
+	{
+		uint64_t hits;			// engines taken back out of the pool
+		uint64_t misses;		// engines that had to be made
+		uint64_t returns;		// engines given back and kept
+		uint64_t discards;		// engines given back with the pool full
+		uint64_t idle;			// engines held now
+	} engine_pool_stats;
+
+	// Keeps engines between jobs, reset, with the streams, paths, kernel tables and worker threads
+	// they have built up, so that a job taken from the pool starts without allocating any of them.
+	// The engines it makes take their I/O blocks from buffers. Safe to share between threads.
+	class engine_pool
+	{
+	private:
+		std::mutex lock;
+		std::vector<std::unique_ptr<whisper_engine>> idle;	// most recently given back last
+		size_t limit;
+		buffer_pool* buffers;
+		engine_pool_stats counters;
+	public:
+		engine_pool(buffer_pool* buffers, size_t limit = default_idle_engines);
+		engine_pool(const engine_pool&) = delete;
+		engine_pool& operator=(const engine_pool&) = delete;
+
+		// An engine keeps the settings it was given back with; callers set all they rely on.
+		std::unique_ptr<whisper_engine> acquire();
+		void give_back(std::unique_ptr<whisper_engine> engine);
+		void set_limit(size_t engines);
+		engine_pool_stats stats();
+	};
+
+	// An engine from a pool for as long as it is in scope.
+	class engine_lease
+	{
+	private:
+		engine_pool& pool;
+		std::unique_ptr<whisper_engine> engine;
+	public:
+		engine_lease(engine_pool& from) : pool(from), engine(from.acquire()) {}
+		~engine_lease() { pool.give_back(std::move(engine)); }
+		engine_lease(const engine_lease&) = delete;
+		engine_lease& operator=(const engine_lease&) = delete;
+
+		whisper_engine& operator*() { return *engine; }
+		whisper_engine* operator->() { return engine.get(); }
+	};
+
+	// The pool batches and the in-process interface share, on shared_buffer_pool().
+	engine_pool& shared_engine_pool();
+}
@@ -0,0 +1,99 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_stats.h"
+
+#include <cstdio>
+
+using namespace whisper;
+
+const char* whisper::stats_stage_name(stats_stage stage, bool encode)
+{
+	static const char* const encode_names[stage_count] = { "capacity_check", "header_copy", "metadata_embed", "filename_embed", "payload_embed", "tail_copy" };
+	static const char* const decode_names[stage_count] = { nullptr, "header_read", "metadata_decode", "filename_decode", "payload_decode", nullptr };
+
+	if (stage < 0 || stage >= stage_count)
+		return nullptr;
+	return encode ? encode_names[stage] : decode_names[stage];
+}
+
+void whisper::add_stage_stats(stage_stats& to, const stage_stats& from)
+{
+	to.seconds += from.seconds;
+	to.samples_scanned += from.samples_scanned;
+	to.eligible_samples += from.eligible_samples;
+	to.bits += from.bits;
+	to.bytes_read += from.bytes_read;
+	to.bytes_written += from.bytes_written;
+	to.io_calls += from.io_calls;
+}
+
+std::string whisper::json_string(const std::string& text)
+{
+	std::string quoted = "\"";
+
+	for (char c : text)
+	{
+		if (c == '"' || c == '\\')
+		{
+			quoted += '\\';
+			quoted += c;
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			char escape[8];
+			snprintf(escape, sizeof(escape), "\\u%04x", (unsigned)c);
+			quoted += escape;
+		}
+		else
+			quoted += c;
+	}
+	return quoted + "\"";
+}
+
+static void write_stage_fields(std::ostream& out, const stage_stats& stage)
+{
+	char seconds[32];
+
+	snprintf(seconds, sizeof(seconds), "%.6f", stage.seconds);
+	out << "\"seconds\": " << seconds
+		<< ", \"samples_scanned\": " << stage.samples_scanned
+		<< ", \"eligible_samples\": " << stage.eligible_samples
+		<< ", \"bits\": " << stage.bits
+		<< ", \"bytes_read\": " << stage.bytes_read
+		<< ", \"bytes_written\": " << stage.bytes_written
+		<< ", \"io_calls\": " << stage.io_calls;
+}
+
+void whisper::write_stats_json(std::ostream& out, const engine_stats& stats, const std::string& indent)
+{
+	stage_stats total = { 0 };
+	bool first = true;
+
+	out << "{" << std::endl;
+	out << indent << "  \"operation\": \"" << (stats.encode ? "encode" : "decode") << "\"," << std::endl;
+	out << indent << "  \"stages\": [";
+	for (int stage = 0; stage < stage_count; stage++)
+	{
+		const char* name = stats_stage_name((stats_stage)stage, stats.encode);
+		if (!name)
+			continue;
+		out << (first ? "" : ",") << std::endl << indent << "    { \"stage\": \"" << name << "\", ";
+		write_stage_fields(out, stats.stages[stage]);
+		out << " }";
+		add_stage_stats(total, stats.stages[stage]);
+		first = false;
+	}
+	out << std::endl << indent << "  ]," << std::endl;
+	out << indent << "  \"total\": { ";
+	write_stage_fields(out, total);
+	out << " }" << std::endl;
+	out << indent << "}";
+}
@@ -0,0 +1,59 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+namespace whisper
+{
+	// The stages of a job in the order they run; a decode has no capacity check and no tail.
+	enum stats_stage
+	{
+		stage_capacity_check,	// the read-ahead through the carrier before the output is created
+		stage_header,			// the WAV header, copied or read
+		stage_metadata,			// the whisper metadata
+		stage_filename,
+		stage_payload,
+		stage_tail,				// the carrier past the last sample used
+		stage_count
+	};
+
+	typedef struct stage_stats
+	{
+		double seconds;
+		uint64_t samples_scanned;		// carrier samples gone through
+		uint64_t eligible_samples;		// of those, the ones holding payload bits
+		uint64_t bits;					// embedded or extracted
+		uint64_t bytes_read;			// carrier and payload bytes taken in, from files, streams or memory
+		uint64_t bytes_written;			// encoded media and decoded data bytes put out
+		uint64_t io_calls;				// reads, writes and kernel copies issued for them
+	} stage_stats;
+
+	// Filled in as an engine runs a job, from the opening of its files on.
+	typedef struct engine_stats
+	{
+		bool encode;
+		stage_stats stages[stage_count];
+	} engine_stats;
+
+	// As --stats names it; null for a stage the operation does not have.
+	const char* stats_stage_name(stats_stage stage, bool encode);
+
+	void add_stage_stats(stage_stats& to, const stage_stats& from);
+
+	std::string json_string(const std::string& text);	// quoted and escaped
+
+	// An object with the operation, a "stages" array and their "total", each line after the first
+	// starting with indent.
+	void write_stats_json(std::ostream& out, const engine_stats& stats, const std::string& indent = "");
+}
@@ -0,0 +1,200 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#include "whisper_threads.h"
+
+#include <algorithm>
+
+using namespace whisper;
+
+size_t whisper::default_thread_count()
+{
+	size_t threads = std::thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
+
+parallel_runner::parallel_runner()
+	: task(nullptr), task_count(0), next_task(0), pending(0), generation(0), stopping(false)
+{
+}
+
+parallel_runner::~parallel_runner()
+{
+	resize(1);
+}
+
+void parallel_runner::resize(size_t threads)
+{
+	if (threads < 1)
+		threads = 1;
+	if (threads == size())
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+	workers.clear();
+
+	stopping = false;
+	for (size_t index = 1; index < threads; index++)
+		workers.emplace_back(&parallel_runner::worker_loop, this);
+}
+
+void parallel_runner::run(size_t count, const std::function<void(size_t)>& work)
+{
+	if (workers.empty() || count < 2)
+	{
+		for (size_t index = 0; index < count; index++)
+			work(index);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		task = &work;
+		task_count = count;
+		next_task = 0;
+		pending = count;
+		generation++;
+	}
+	wake.notify_all();
+
+	pull_tasks();
+
+	std::unique_lock<std::mutex> guard(lock);
+	done.wait(guard, [this] { return pending == 0; });
+	task = nullptr;
+	task_count = 0;
+}
+
+void parallel_runner::pull_tasks()
+{
+	for (;;)
+	{
+		size_t index = 0;
+		const std::function<void(size_t)>* work = nullptr;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (next_task >= task_count)
+				return;
+			index = next_task++;
+			work = task;
+		}
+
+		(*work)(index);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (--pending == 0)
+			done.notify_all();
+	}
+}
+
+void parallel_runner::worker_loop()
+{
+	uint64_t seen = 0;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			wake.wait(guard, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+		pull_tasks();
+	}
+}
+
+bool work_stealing_pool::take(size_t thread, size_t& index)
+{
+	task_range& own = *ranges[thread];
+	std::lock_guard<std::mutex> guard(own.lock);
+
+	if (own.next >= own.end)
+		return false;
+	index = own.next++;
+	return true;
+}
+
+bool work_stealing_pool::steal(size_t thread)
+{
+	for (;;)
+	{
+		size_t victim = thread;
+		size_t most = 0;
+
+		for (size_t other = 0; other < ranges.size(); other++)
+		{
+			std::lock_guard<std::mutex> guard(ranges[other]->lock);
+			size_t left = ranges[other]->end - ranges[other]->next;
+			if (other != thread && left > most)
+			{
+				most = left;
+				victim = other;
+			}
+		}
+		if (!most)
+			return false;
+
+		size_t begin = 0;
+		size_t end = 0;
+		{
+			std::lock_guard<std::mutex> guard(ranges[victim]->lock);
+			task_range& range = *ranges[victim];
+			if (range.next >= range.end)
+				continue;	// drained since the scan; look again
+			end = range.end;
+			begin = range.next + (range.end - range.next) / 2;
+			range.end = begin;
+		}
+
+		std::lock_guard<std::mutex> guard(ranges[thread]->lock);
+		ranges[thread]->next = begin;
+		ranges[thread]->end = end;
+		return true;
+	}
+}
+
+void work_stealing_pool::run(size_t threads, size_t count, const std::function<void(size_t, size_t)>& task)
+{
+	threads = std::max<size_t>(1, std::min(threads, count));
+
+	ranges.clear();
+	for (size_t thread = 0; thread < threads; thread++)
+	{
+		ranges.emplace_back(new task_range);
+		ranges[thread]->next = count * thread / threads;
+		ranges[thread]->end = count * (thread + 1) / threads;
+	}
+
+	auto work = [&](size_t thread)
+	{
+		size_t index = 0;
+
+		do
+		{
+			while (take(thread, index))
+				task(index, thread);
+		} while (steal(thread));
+	};
+
+	std::vector<std::thread> helpers;
+	for (size_t thread = 1; thread < threads; thread++)
+		helpers.emplace_back(work, thread);
+	work(0);
+	for (auto& helper : helpers)
+		helper.join();
+	ranges.clear();
+}
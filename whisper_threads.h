@@ -0,0 +1,139 @@
+/************************************************************************
+ **                                                                    **
+ **                           Whisper 1.0                              **
+ **                 Copyright 2023 Steven D.Nichols                    **
+ **    A steganographic tool for concealing data within audio files    **
+ **                                                                    **
+ **  Whisper can be found at http ://github.com/stevendnichols/whisper **
+ **                                                                    **
+ ************************************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+namespace whisper
+{
+	// Fork-join helper: run() calls task(0) .. task(count - 1) on a fixed set of worker
+	// threads plus the calling thread, and returns once all of them have finished.
+	class parallel_runner
+	{
+	private:
+		std::vector<std::thread> workers;
+		std::mutex lock;
+		std::condition_variable wake;
+		std::condition_variable done;
+		const std::function<void(size_t)>* task;
+		size_t task_count;
+		size_t next_task;
+		size_t pending;
+		uint64_t generation;
+		bool stopping;
+
+		void pull_tasks();
+		void worker_loop();
+	public:
+		parallel_runner();
+		~parallel_runner();
+		parallel_runner(const parallel_runner&) = delete;
+		parallel_runner& operator=(const parallel_runner&) = delete;
+
+		void resize(size_t threads);				// total threads, including the caller
+		size_t size() const { return workers.size() + 1; }
+		void run(size_t count, const std::function<void(size_t)>& task);
+	};
+
+	// For long, uneven tasks such as whole batch jobs: runs task(index, thread) for every index
+	// below count on threads threads, the caller being thread 0. Each thread starts on its own
+	// contiguous share of the indices and, when that runs out, steals the back half of the
+	// largest share left, so no thread idles while another has a queue of work.
+	class work_stealing_pool
+	{
+	private:
+		typedef struct task_range
+		{
+			std::mutex lock;
+			size_t next;
+			size_t end;
+		} task_range;
+
+		std::vector<std::unique_ptr<task_range>> ranges;
+
+		bool take(size_t thread, size_t& index);
+		bool steal(size_t thread);
+	public:
+		void run(size_t threads, size_t count, const std::function<void(size_t, size_t)>& task);
+	};
+
+	size_t default_thread_count();
+
+	// Waiting in a loop that polls: spins a little, then yields, then sleeps between polls.
+	inline void backoff(unsigned& spins)
+	{
+		if (++spins < 64)
+			return;
+		if (spins < 1024)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+
+	// Lock-free ring between one producer thread and one consumer thread, holding up to capacity
+	// items, rounded up to a power of two. Each side only moves its own index, and the release
+	// store of it publishes the slot it has just filled or emptied to the other side.
+	template<typename T>
+	class spsc_ring
+	{
+	private:
+		std::vector<T> slots;
+		size_t mask;
+		alignas(64) std::atomic<size_t> head;	// next slot to pop, moved by the consumer
+		alignas(64) std::atomic<size_t> tail;	// next slot to push, moved by the producer
+	public:
+		spsc_ring() : mask(0), head(0), tail(0) {}
+		spsc_ring(const spsc_ring&) = delete;
+		spsc_ring& operator=(const spsc_ring&) = delete;
+
+		void reset(size_t capacity)				// empties the ring; neither side may be using it
+		{
+			size_t size = 1;
+			while (size < capacity)
+				size <<= 1;
+			slots.assign(size, T());
+			mask = size - 1;
+			head.store(0, std::memory_order_relaxed);
+			tail.store(0, std::memory_order_relaxed);
+		}
+
+		bool try_push(const T& item)
+		{
+			size_t at = tail.load(std::memory_order_relaxed);
+			if (at - head.load(std::memory_order_acquire) > mask)
+				return false;
+			slots[at & mask] = item;
+			tail.store(at + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool try_pop(T& item)
+		{
+			size_t at = head.load(std::memory_order_relaxed);
+			if (at == tail.load(std::memory_order_acquire))
+				return false;
+			item = slots[at & mask];
+			head.store(at + 1, std::memory_order_release);
+			return true;
+		}
+
+		size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+	};
+}